@@ -0,0 +1,65 @@
+#!/bin/sh
+# Run the keyboard_dis command engine against the simulated controller,
+# no i8042 needed. Build the module with "make" first, run as root with
+# debugfs mounted.
+#
+#   ./kbd_sim_test.sh
+#
+# normal: the controller stays busy sim_busy_polls=3 polls after every
+#         command, so each command after the first backs off 50+100+200 us
+#         and still completes
+# wedged: the input buffer never drains, every command times out after
+#         retry_budget polls and nothing reaches the controller
+#
+# Exits 1 if a counter in keyboard_dis/stats is not what the case expects.
+
+STATS=/sys/kernel/debug/keyboard_dis/stats
+FAIL=0
+
+stat() {
+	sed -n "s/^$1: //p" $STATS
+}
+
+expect() {
+	VAL=$(stat $1)
+	if [ "$VAL" != "$2" ]; then
+		echo "FAIL $CASE: $1 = $VAL, expected $2"
+		FAIL=1
+	fi
+}
+
+load() {
+	insmod ./keyboard_dis.ko mode=i8042 port_name=sim block_ms=100 "$@" || exit 1
+}
+
+CASE=normal
+load sim_busy_polls=3 retry_budget=20
+sleep 0.3
+# second window, disable + enable again
+echo 100 > /sys/module/keyboard_dis/parameters/block_now
+sleep 0.3
+cat $STATS
+expect submitted 4
+expect completed 4
+expect timeouts 0
+expect dropped 0
+expect sim_keyboard enabled
+LAT=$(stat latency_max_ns)
+if [ "${LAT:-0}" -lt 350000 ]; then
+	echo "FAIL $CASE: latency_max_ns = $LAT, backoff over 3 busy polls takes at least 350000"
+	FAIL=1
+fi
+rmmod keyboard_dis
+
+CASE=wedged
+load sim_wedged=1 retry_budget=5
+sleep 0.3
+cat $STATS
+expect submitted 2
+expect completed 0
+expect timeouts 2
+expect sim_keyboard enabled
+rmmod keyboard_dis
+
+[ $FAIL -eq 0 ] && echo "PASS"
+exit $FAIL
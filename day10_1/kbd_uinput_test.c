@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+/*
+ * Virtual keyboard for testing keyboard_dis mode=input without hardware.
+ *   insmod keyboard_dis.ko mode=input match_name=kbd_uinput_test block_ms=5000
+ *   ./kbd_uinput_test 100     -> 0 presses received while the window is open
+ * Key releases always pass the filter. Exits 1 if any press gets through
+ * or a release is lost, so run it while the window is open.
+ */
+
+#define DEV_NAME "kbd_uinput_test"
+
+static void emit(int fd, int type, int code, int value)
+{
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    write(fd, &ev, sizeof(ev));
+}
+
+// event node of the uinput device, via /sys/class/input/inputN/eventM
+static int open_event_node(int ufd)
+{
+    char sysname[64], path[300];
+    struct dirent *de;
+    DIR *dir;
+    int fd = -1;
+
+    if (ioctl(ufd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
+        return -1;
+    snprintf(path, sizeof(path), "/sys/class/input/%s", sysname);
+    dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (strncmp(de->d_name, "event", 5) == 0)
+        {
+            snprintf(path, sizeof(path), "/dev/input/%s", de->d_name);
+            fd = open(path, O_RDONLY | O_NONBLOCK);
+            break;
+        }
+    }
+    closedir(dir);
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    struct uinput_setup setup;
+    struct input_event ev;
+    int ufd, efd, i, n, received = 0, released = 0;
+
+    n = argc > 1 ? atoi(argv[1]) : 10;
+
+    ufd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (ufd < 0)
+    {
+        perror("open() failed");
+        _exit(1);
+    }
+    ioctl(ufd, UI_SET_EVBIT, EV_KEY);
+    ioctl(ufd, UI_SET_KEYBIT, KEY_A);
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    strcpy(setup.name, DEV_NAME);
+    ioctl(ufd, UI_DEV_SETUP, &setup);
+    if (ioctl(ufd, UI_DEV_CREATE) < 0)
+    {
+        perror("UI_DEV_CREATE failed");
+        _exit(1);
+    }
+    // let the input core connect handlers to the new device
+    usleep(200000);
+
+    efd = open_event_node(ufd);
+    if (efd < 0)
+    {
+        perror("event node open() failed");
+        _exit(1);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        emit(ufd, EV_KEY, KEY_A, 1);
+        emit(ufd, EV_SYN, SYN_REPORT, 0);
+        emit(ufd, EV_KEY, KEY_A, 0);
+        emit(ufd, EV_SYN, SYN_REPORT, 0);
+    }
+    usleep(50000);
+
+    while (read(efd, &ev, sizeof(ev)) == sizeof(ev))
+    {
+        if (ev.type == EV_KEY && ev.value == 1)
+            received++;
+        else if (ev.type == EV_KEY && ev.value == 0)
+            released++;
+    }
+    printf("sent %d presses, received %d, releases %d\n", n, received, released);
+
+    close(efd);
+    ioctl(ufd, UI_DEV_DESTROY);
+    close(ufd);
+    if (received != 0 || released != n)
+    {
+        printf("FAIL: %s\n", received != 0 ? "presses not suppressed" : "releases lost");
+        return 1;
+    }
+    return 0;
+}
@@ -1,44 +1,427 @@
 #include <linux/module.h>
 #include <linux/timer.h>
-#include <linux/delay.h>
+#include <linux/math64.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/string.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/input.h>
+#include <linux/slab.h>
 #include <asm-generic/io.h>
 
 #define KBD_DATA_REG     0x60
-#define KBD_CTRL_REG     0x64 
+#define KBD_CTRL_REG     0x64
 
-struct timer_list mytimer;
-int ticks;
-int count = 0;
+#define KBD_STATUS_IBF   0x02	// input buffer full, controller can't take a command yet
+#define KBD_CMD_DISABLE  0xAD
+#define KBD_CMD_ENABLE   0xAE
 
-void mytimer_function(struct timer_list *ptimer) {
+#define KBD_QUEUE_LEN       8
+#define KBD_BACKOFF_MIN_US  50
+#define KBD_BACKOFF_MAX_US  10000
+
+static char *mode = "i8042";
+module_param(mode, charp, 0444);
+MODULE_PARM_DESC(mode, "i8042 = disable the controller, input = drop key events in the input layer");
+static unsigned int block_ms = 10000;
+module_param(block_ms, uint, 0644);
+MODULE_PARM_DESC(block_ms, "length of the blocking window started at load");
+static char *match_name = "";
+module_param(match_name, charp, 0444);
+MODULE_PARM_DESC(match_name, "input mode: only block devices whose name contains this, empty = all keyboards");
+static char *port_name = "hw";
+module_param(port_name, charp, 0444);
+MODULE_PARM_DESC(port_name, "controller port: hw = i8042 at 0x60/0x64, sim = simulated controller");
+static unsigned int retry_budget = 20;
+module_param(retry_budget, uint, 0644);
+MODULE_PARM_DESC(retry_budget, "status polls per command before it is dropped as timed out");
+static unsigned int sim_busy_polls = 3;
+module_param(sim_busy_polls, uint, 0644);
+MODULE_PARM_DESC(sim_busy_polls, "sim port: polls the input buffer stays full after each command");
+static bool sim_wedged;
+module_param(sim_wedged, bool, 0644);
+MODULE_PARM_DESC(sim_wedged, "sim port: input buffer never drains, to exercise timeouts");
+
+/*
+ * Controller I/O goes through a port, so the command engine can run
+ * against a simulated controller on hosts without an i8042.
+ */
+struct kbd_port {
+	const char *name;
+	u8 (*status)(struct kbd_port *port);
+	void (*command)(struct kbd_port *port, u8 cmd);
+};
+
+static u8 hw_status(struct kbd_port *port) {
+	return inb(KBD_CTRL_REG);
+}
+
+static void hw_command(struct kbd_port *port, u8 cmd) {
+	outb(cmd, KBD_CTRL_REG);
+}
+
+static struct kbd_port hw_port = {
+	.name = "hw",
+	.status = hw_status,
+	.command = hw_command,
+};
+
+struct kbd_sim {
+	struct kbd_port port;
+	unsigned int busy_left;	// polls till input buffer drains
+	bool kbd_enabled;
+	u8 last_cmd;
+};
+
+static u8 sim_status(struct kbd_port *port) {
+	struct kbd_sim *sim = container_of(port, struct kbd_sim, port);
+
+	if(sim_wedged)
+		return KBD_STATUS_IBF;
+	if(sim->busy_left > 0) {
+		sim->busy_left--;
+		return KBD_STATUS_IBF;
+	}
+	return 0;
+}
+
+static void sim_command(struct kbd_port *port, u8 cmd) {
+	struct kbd_sim *sim = container_of(port, struct kbd_sim, port);
+
+	sim->last_cmd = cmd;
+	if(cmd == KBD_CMD_DISABLE)
+		sim->kbd_enabled = false;
+	else if(cmd == KBD_CMD_ENABLE)
+		sim->kbd_enabled = true;
+	sim->busy_left = sim_busy_polls;
+}
+
+static struct kbd_sim sim_port = {
+	.port = {
+		.name = "sim",
+		.status = sim_status,
+		.command = sim_command,
+	},
+	.kbd_enabled = true,
+};
+
+static struct kbd_port *port;
+
+/*
+ * Command engine. Commands are queued by kbd_submit() and written by
+ * kbd_engine_fn(), which polls the status once per hrtimer expiry and backs
+ * off exponentially while the controller is busy. Nothing ever spins.
+ */
+struct kbd_cmd {
+	u8 cmd;
+	u64 submit_ns;
+};
+
+static DEFINE_SPINLOCK(kbd_lock);	// protects queue, engine state and stats
+static struct kbd_cmd kbd_queue[KBD_QUEUE_LEN];
+static unsigned int kbd_head, kbd_len;
+static unsigned int kbd_polls;	// status polls spent on the head command
+static bool kbd_busy;	// kbd_timer armed
+static struct hrtimer kbd_timer;
+static DECLARE_WAIT_QUEUE_HEAD(kbd_idle_wq);
+static u64 kbd_submitted, kbd_completed, kbd_timeouts, kbd_dropped;
+static u64 kbd_lat_min, kbd_lat_max, kbd_lat_sum;	// submit to write, completed commands only
+static struct dentry *kbd_dir;
+
+static DEFINE_SPINLOCK(win_lock);	// orders window start against window end
+static bool use_input;	// mode=input
+static bool kbd_ready;	// block_now writes accepted, under win_lock
+static bool kbd_disabled;	// i8042 mode: enable command not submitted yet
+static bool blocking;	// input mode: window open
+static atomic_t kbd_input_devices;
+static atomic64_t kbd_suppressed;
+int count = 0;	// windows ended
+
+static void kbd_pop(void) {
+	kbd_head = (kbd_head + 1) % KBD_QUEUE_LEN;
+	kbd_len--;
+	kbd_polls = 0;
+}
+
+static enum hrtimer_restart kbd_engine_fn(struct hrtimer *timer) {
+	struct kbd_cmd *cmd;
+	unsigned long delay_us;
+	u64 lat;
+
+	spin_lock(&kbd_lock);
+	while(kbd_len > 0) {
+		cmd = &kbd_queue[kbd_head];
+		if(port->status(port) & KBD_STATUS_IBF) {
+			if(++kbd_polls > retry_budget) {
+				kbd_timeouts++;
+				printk(KERN_ERR " %s : command 0x%02x timed out after %u polls\n", THIS_MODULE->name, cmd->cmd, retry_budget);
+				kbd_pop();
+				continue;
+			}
+			delay_us = min(KBD_BACKOFF_MIN_US << min(kbd_polls - 1, 8U), KBD_BACKOFF_MAX_US);
+			hrtimer_forward_now(timer, us_to_ktime(delay_us));
+			spin_unlock(&kbd_lock);
+			return HRTIMER_RESTART;
+		}
+
+		port->command(port, cmd->cmd);
+		lat = ktime_get_ns() - cmd->submit_ns;
+		if(kbd_completed == 0 || lat < kbd_lat_min)
+			kbd_lat_min = lat;
+		if(lat > kbd_lat_max)
+			kbd_lat_max = lat;
+		kbd_lat_sum += lat;
+		kbd_completed++;
+		printk(KERN_INFO " %s : command 0x%02x done in %llu ns, %u busy polls\n", THIS_MODULE->name, cmd->cmd, lat, kbd_polls);
+		kbd_pop();
+	}
+	kbd_busy = false;
+	spin_unlock(&kbd_lock);
+	wake_up(&kbd_idle_wq);
+	return HRTIMER_NORESTART;
+}
+
+// safe from any context, completion or timeout is reported by the engine
+static int kbd_submit(u8 cmd) {
+	unsigned long flags;
+	bool start = false;
+
+	spin_lock_irqsave(&kbd_lock, flags);
+	if(kbd_len == KBD_QUEUE_LEN) {
+		kbd_dropped++;
+		spin_unlock_irqrestore(&kbd_lock, flags);
+		return -ENOSPC;
+	}
+	kbd_queue[(kbd_head + kbd_len) % KBD_QUEUE_LEN].cmd = cmd;
+	kbd_queue[(kbd_head + kbd_len) % KBD_QUEUE_LEN].submit_ns = ktime_get_ns();
+	kbd_len++;
+	kbd_submitted++;
+	if(!kbd_busy) {
+		kbd_busy = true;
+		start = true;
+	}
+	spin_unlock_irqrestore(&kbd_lock, flags);
+
+	if(start)
+		hrtimer_start(&kbd_timer, 0, HRTIMER_MODE_REL);
+	return 0;
+}
+
+static int kbd_stats_show(struct seq_file *m, void *v) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&kbd_lock, flags);
+	seq_printf(m, "port: %s\n", port->name);
+	seq_printf(m, "queued: %u\n", kbd_len);
+	seq_printf(m, "submitted: %llu\n", kbd_submitted);
+	seq_printf(m, "completed: %llu\n", kbd_completed);
+	seq_printf(m, "timeouts: %llu\n", kbd_timeouts);
+	seq_printf(m, "dropped: %llu\n", kbd_dropped);
+	seq_printf(m, "latency_min_ns: %llu\n", kbd_lat_min);
+	seq_printf(m, "latency_avg_ns: %llu\n", kbd_completed ? div64_u64(kbd_lat_sum, kbd_completed) : 0);
+	seq_printf(m, "latency_max_ns: %llu\n", kbd_lat_max);
+	if(port == &sim_port.port)
+		seq_printf(m, "sim_keyboard: %s\n", sim_port.kbd_enabled ? "enabled" : "disabled");
+	spin_unlock_irqrestore(&kbd_lock, flags);
+	seq_printf(m, "windows: %d\n", READ_ONCE(count));
+	seq_printf(m, "blocking: %d\n", READ_ONCE(blocking));
+	seq_printf(m, "input_devices: %d\n", atomic_read(&kbd_input_devices));
+	seq_printf(m, "suppressed: %lld\n", (long long)atomic64_read(&kbd_suppressed));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kbd_stats);
+
+/*
+ * Input mode: a filter handler sits in front of evdev and the console on
+ * every matching keyboard and drops key presses and repeats while a window
+ * is open. Releases always pass so no key gets stuck down.
+ */
+static bool kbd_filter(struct input_handle *handle, unsigned int type, unsigned int code, int value) {
+	if(type != EV_KEY || value == 0 || !READ_ONCE(blocking))
+		return false;
+	atomic64_inc(&kbd_suppressed);
+	return true;
+}
+
+static int kbd_connect(struct input_handler *handler, struct input_dev *dev, const struct input_device_id *id) {
+	struct input_handle *handle;
+	int ret;
+
+	if(match_name[0] != '\0' && (dev->name == NULL || strstr(dev->name, match_name) == NULL))
+		return -ENODEV;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if(handle == NULL)
+		return -ENOMEM;
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "keyboard_dis";
+
+	ret = input_register_handle(handle);
+	if(ret != 0)
+		goto register_failed;
+	ret = input_open_device(handle);
+	if(ret != 0)
+		goto open_failed;
+	atomic_inc(&kbd_input_devices);
+	printk(KERN_INFO " %s : filtering %s\n", THIS_MODULE->name, dev->name);
+	return 0;
+
+open_failed:
+	input_unregister_handle(handle);
+register_failed:
+	kfree(handle);
+	return ret;
+}
+
+static void kbd_disconnect(struct input_handle *handle) {
+	atomic_dec(&kbd_input_devices);
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+// EV_KEY alone also matches mice, power buttons and lids, so require a
+// typing key like the console keyboard handler does
+static const struct input_device_id kbd_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_KEYBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+		.keybit = { [BIT_WORD(KEY_A)] = BIT_MASK(KEY_A) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_KEYBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+		.keybit = { [BIT_WORD(KEY_SPACE)] = BIT_MASK(KEY_SPACE) },
+	},
+	{ },
+};
+
+static struct input_handler kbd_handler = {
+	.filter = kbd_filter,
+	.connect = kbd_connect,
+	.disconnect = kbd_disconnect,
+	.name = "keyboard_dis",
+	.id_table = kbd_ids,
+};
+
+static struct hrtimer mytimer;	// end of the blocking window
+
+enum hrtimer_restart mytimer_function(struct hrtimer *ptimer) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&win_lock, flags);
 	printk(KERN_INFO " %s : mytimer_function : count = %d\n", THIS_MODULE->name, count);
 	count++;
 
 	// enable keyboard
-	while(inb(KBD_CTRL_REG) & 0x02)
-		mdelay(1);
-	outb(0xAE, KBD_CTRL_REG);
+	WRITE_ONCE(blocking, false);
+	if(kbd_disabled) {
+		kbd_disabled = false;
+		if(kbd_submit(KBD_CMD_ENABLE) != 0)
+			printk(KERN_ERR " %s : command queue full, keyboard stays disabled\n", THIS_MODULE->name);
+	}
+	spin_unlock_irqrestore(&win_lock, flags);
+	return HRTIMER_NORESTART;
+}
+
+// open a window of ms, or move the end of the open one to now + ms
+static int kbd_block(unsigned int ms) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&win_lock, flags);
+	// checked under win_lock so nothing arms mytimer after desd_exit cancelled it
+	if(!kbd_ready) {
+		spin_unlock_irqrestore(&win_lock, flags);
+		return -EAGAIN;
+	}
+	if(use_input)
+		WRITE_ONCE(blocking, true);
+	else if(!kbd_disabled) {
+		kbd_disabled = true;
+		kbd_submit(KBD_CMD_DISABLE);
+	}
+	hrtimer_start(&mytimer, ms_to_ktime(ms), HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&win_lock, flags);
+	return 0;
+}
+
+// echo <ms> > /sys/module/keyboard_dis/parameters/block_now re-arms the window
+static int block_now_set(const char *val, const struct kernel_param *kp) {
+	unsigned int ms;
+	int ret;
+
+	ret = kstrtouint(val, 10, &ms);
+	if(ret != 0)
+		return ret;
+	return kbd_block(ms);
 }
 
+static const struct kernel_param_ops block_now_ops = {
+	.set = block_now_set,
+};
+module_param_cb(block_now, &block_now_ops, NULL, 0200);
+MODULE_PARM_DESC(block_now, "write a duration in ms to start or re-arm a blocking window");
+
 static __init int desd_init(void) {
-	int sec = 10;
-	ticks = sec * HZ;		
+	int ret;
+
+	if(strcmp(mode, "input") == 0)
+		use_input = true;
+	else if(strcmp(mode, "i8042") != 0)
+		return -EINVAL;
+
+	if(strcmp(port_name, "sim") == 0)
+		port = &sim_port.port;
+	else if(strcmp(port_name, "hw") == 0)
+		port = &hw_port;
+	else
+		return -EINVAL;
 
-	timer_setup(&mytimer, mytimer_function, 0);
-	mytimer.expires = jiffies + ticks;
-	add_timer(&mytimer);
+	hrtimer_init(&kbd_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	kbd_timer.function = kbd_engine_fn;
+	kbd_dir = debugfs_create_dir("keyboard_dis", NULL);
+	debugfs_create_file("stats", 0444, kbd_dir, NULL, &kbd_stats_fops);
+
+	hrtimer_init(&mytimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	mytimer.function = mytimer_function;
+
+	if(use_input) {
+		ret = input_register_handler(&kbd_handler);
+		if(ret != 0) {
+			debugfs_remove_recursive(kbd_dir);
+			return ret;
+		}
+	}
 
 	// disable keyboard
-	while(inb(KBD_CTRL_REG) & 0x02)
-		mdelay(1);
-	outb(0xAD, KBD_CTRL_REG);
+	WRITE_ONCE(kbd_ready, true);
+	kbd_block(block_ms);
 
-	printk(KERN_INFO " %s : Timer initialisation is done successfully\n", THIS_MODULE->name);
+	printk(KERN_INFO " %s : Timer initialisation is done successfully, mode %s, port %s\n", THIS_MODULE->name, mode, port->name);
 	return 0;
 }
 
 static __exit void desd_exit(void) {
-	del_timer_sync(&mytimer);
+	unsigned long flags;
+
+	// block_now writes can still run during exit
+	spin_lock_irqsave(&win_lock, flags);
+	WRITE_ONCE(kbd_ready, false);
+	spin_unlock_irqrestore(&win_lock, flags);
+	hrtimer_cancel(&mytimer);
+	if(use_input)
+		input_unregister_handler(&kbd_handler);
+	// unloaded early, don't leave the keyboard off
+	if(kbd_disabled)
+		kbd_submit(KBD_CMD_ENABLE);
+	wait_event_timeout(kbd_idle_wq, !READ_ONCE(kbd_busy), HZ);
+	hrtimer_cancel(&kbd_timer);
+	debugfs_remove_recursive(kbd_dir);
+	printk(KERN_INFO " %s : %llu commands done, %llu timed out, %lld key events suppressed\n", THIS_MODULE->name, kbd_completed, kbd_timeouts, (long long)atomic64_read(&kbd_suppressed));
 	printk(KERN_INFO " %s : Timer deinitialisation is done successfully\n", THIS_MODULE->name);
 }
 
@@ -47,5 +430,4 @@ module_exit(desd_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Parth");
-MODULE_DESCRIPTION("Disable keyboard for 10 sec");
-
+MODULE_DESCRIPTION("Disable keyboard for block_ms");
@@ -0,0 +1,74 @@
+
+#ifndef __BBB_GPIO_IOCTL_H
+#define __BBB_GPIO_IOCTL_H
+
+#include "linux/ioctl.h"
+
+// switch edge event, read() of /dev/bbb_gpio0 returns arrays of these
+typedef struct {
+    unsigned long long ts_ns; // CLOCK_MONOTONIC time of the edge
+    unsigned int gpio; // gpio number
+    unsigned int edge; // 1 = rising, 0 = falling
+}gpio_event_t;
+
+typedef struct {
+    unsigned long long events; // edges queued for readers
+    unsigned long long overflow; // edges lost because readers were behind
+    unsigned long long debounced; // edges dropped by software debounce
+    unsigned long long irqs; // switch_isr runs
+    unsigned long long coalesced; // level changes found by storm polling, each may stand for many edges
+    unsigned long long storms; // switches from irq to polling mode
+    unsigned long long calms; // switches back to irq mode
+}gpio_ev_stats_t;
+
+#define GPIO_MAX_LINES 64
+
+// bit n is the n-th line of out_gpios / in_gpios (or out-gpios / in-gpios in devicetree)
+typedef struct {
+    unsigned long long mask; // outputs to change
+    unsigned long long value; // new level of each output in mask
+}gpio_out_t;
+
+typedef struct {
+    unsigned long long outputs; // last value driven on each output
+    unsigned long long inputs; // current level of each input
+    unsigned int n_outputs;
+    unsigned int n_inputs;
+}gpio_lines_t;
+
+typedef struct {
+    unsigned long long ts_ns; // CLOCK_MONOTONIC time of the last change
+    unsigned long long toggles; // changes since the driver was bound
+    unsigned int gpio; // gpio number
+    unsigned int value;
+}gpio_line_snap_t;
+
+/*
+ * State of all lines, from GPIO_SNAPSHOT or mmap() of one page of
+ * /dev/bbb_gpio0 (read only). mmap readers copy what they need and retry
+ * if seq was odd or changed meanwhile:
+ *     do { s = snap->seq; rmb(); copy...; rmb(); } while ((s & 1) || s != snap->seq);
+ */
+typedef struct {
+    unsigned int seq; // odd while the driver is updating
+    unsigned int n_outputs;
+    unsigned int n_inputs;
+    unsigned int pad;
+    gpio_line_snap_t line[2 * GPIO_MAX_LINES]; // n_outputs outputs, then n_inputs inputs
+}gpio_snapshot_t;
+
+#define GPIO_LAT_BUCKETS 32
+
+// log2 latency histogram, bucket n counts latencies in [2^(n-1), 2^n) ns
+typedef struct {
+    unsigned long long isr_to_thread[GPIO_LAT_BUCKETS]; // switch isr to blink thread
+}gpio_lat_t;
+
+#define GPIO_EV_STATS _IOR('g', 1, gpio_ev_stats_t)
+#define GPIO_SET_OUTPUTS _IOW('g', 2, gpio_out_t) // one gpiod_set_array_value() for all of mask
+#define GPIO_GET_LINES _IOR('g', 3, gpio_lines_t)
+#define GPIO_LAT_STATS _IOR('g', 4, gpio_lat_t)
+#define GPIO_LAT_RESET _IO('g', 5) // also clears gpio_ev_stats_t
+#define GPIO_SNAPSHOT _IOR('g', 6, gpio_snapshot_t)
+
+#endif
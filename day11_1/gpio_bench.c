@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "bbb_gpio_ioctl.h"
+
+/*
+ * Interrupt path latency benchmark for gpio_workqueue on a gpio-sim chip.
+ * Flips the pull of a simulated switch line and measures
+ *   edge-to-isr:  pull write started -> switch_isr timestamp
+ *   isr-to-read:  switch_isr timestamp -> read() of the event returned
+ * and prints the driver's own isr-to-thread histogram (GPIO_LAT_STATS).
+ * edge-to-isr includes the sysfs write itself, so it is an upper bound.
+ * Exits 1 if the p99 of either exceeds max_p99_us (default 10000).
+ * "storm [toggles]" instead flips the line as fast as it can, ends high,
+ * and checks that the last event readers get is that final rising edge.
+ * See gpio_sim.sh for creating the chip and loading the module.
+ */
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// returns p99
+static unsigned long long print_dist(const char *name, unsigned long long *v, int n)
+{
+    qsort(v, n, sizeof(*v), cmp_u64);
+    printf("%-12s min=%llu p50=%llu p90=%llu p99=%llu max=%llu ns\n", name,
+        v[0], v[n / 2], v[n * 90 / 100], v[n * 99 / 100], v[n - 1]);
+    return v[n * 99 / 100];
+}
+
+static int set_pull(int pull_fd, const char *pull)
+{
+    if (pwrite(pull_fd, pull, strlen(pull), 0) < 0)
+    {
+        perror("pull write failed");
+        return -1;
+    }
+    return 0;
+}
+
+// wait for the next event of wanted edge, older/other events are skipped
+static int wait_edge(int fd, unsigned int edge, gpio_event_t *ev)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (1)
+    {
+        if (poll(&pfd, 1, 1000) <= 0)
+        {
+            printf("no event within 1s, is the line an input of bbb_gpio?\n");
+            return -1;
+        }
+        if (read(fd, ev, sizeof(*ev)) != sizeof(*ev))
+        {
+            perror("read() failed");
+            return -1;
+        }
+        if (ev->edge == edge)
+            return 0;
+    }
+}
+
+static void print_stats(int fd)
+{
+    gpio_ev_stats_t stats;
+    if (ioctl(fd, GPIO_EV_STATS, &stats) == 0)
+        printf("events=%llu, overflow=%llu, debounced=%llu, irqs=%llu, coalesced=%llu, storms=%llu, calms=%llu\n",
+            stats.events, stats.overflow, stats.debounced, stats.irqs, stats.coalesced, stats.storms, stats.calms);
+}
+
+// bouncing switch: many edges, the final level must still be reported
+static int storm(int fd, int pull_fd, int toggles)
+{
+    gpio_event_t ev;
+    int i, n = 0, last = -1;
+
+    set_pull(pull_fd, "pull-down");
+    usleep(300000);
+    ioctl(fd, GPIO_LAT_RESET);
+    while (poll(&(struct pollfd){ .fd = fd, .events = POLLIN }, 1, 0) > 0)
+        read(fd, &ev, sizeof(ev));
+
+    for (i = 0; i < toggles; i++)
+        set_pull(pull_fd, i % 2 == 0 ? "pull-up" : "pull-down");
+    set_pull(pull_fd, "pull-up");
+    // past storm_quiet_ms, the line is back in irq mode
+    usleep(300000);
+    while (poll(&(struct pollfd){ .fd = fd, .events = POLLIN }, 1, 0) > 0 && read(fd, &ev, sizeof(ev)) == sizeof(ev))
+    {
+        n++;
+        last = ev.edge;
+    }
+    printf("%d pull flips, %d events read, last edge %s\n", toggles, n, last == 1 ? "rising (ok)" : "LOST");
+    print_stats(fd);
+    return last == 1 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long *edge_to_isr, *isr_to_read, t0, t2, max_p99_ns;
+    gpio_event_t ev;
+    gpio_lat_t lat;
+    int fd, pull_fd, i, n, gap_us, ret = 0;
+
+    if (argc < 2)
+    {
+        printf("usage: %s <sim_gpioN/pull path> [iterations] [gap_us] [max_p99_us]\n", argv[0]);
+        printf("       %s <sim_gpioN/pull path> storm [toggles]\n", argv[0]);
+        _exit(2);
+    }
+    n = argc > 2 ? atoi(argv[2]) : 1000;
+    gap_us = argc > 3 ? atoi(argv[3]) : 1000;
+    max_p99_ns = (argc > 4 ? strtoull(argv[4], NULL, 0) : 10000) * 1000;
+    if (n <= 0)
+        n = 1;
+
+    fd = open("/dev/bbb_gpio0", O_RDONLY);
+    if (fd < 0)
+    {
+        perror("open() failed");
+        _exit(1);
+    }
+    pull_fd = open(argv[1], O_WRONLY);
+    if (pull_fd < 0)
+    {
+        perror("pull open() failed");
+        _exit(1);
+    }
+    if (argc > 2 && strcmp(argv[2], "storm") == 0)
+        return storm(fd, pull_fd, argc > 3 ? atoi(argv[3]) : 10000);
+    edge_to_isr = calloc(n, sizeof(*edge_to_isr));
+    isr_to_read = calloc(n, sizeof(*isr_to_read));
+
+    // start low with empty histograms
+    set_pull(pull_fd, "pull-down");
+    usleep(10000);
+    ioctl(fd, GPIO_LAT_RESET);
+    while (poll(&(struct pollfd){ .fd = fd, .events = POLLIN }, 1, 0) > 0)
+        read(fd, &ev, sizeof(ev));
+
+    for (i = 0; i < n; i++)
+    {
+        t0 = now_ns();
+        if (set_pull(pull_fd, "pull-up") < 0 || wait_edge(fd, 1, &ev) < 0)
+        {
+            ret = 1;
+            break;
+        }
+        t2 = now_ns();
+        edge_to_isr[i] = ev.ts_ns - t0;
+        isr_to_read[i] = t2 - ev.ts_ns;
+
+        if (set_pull(pull_fd, "pull-down") < 0 || wait_edge(fd, 0, &ev) < 0)
+        {
+            ret = 1;
+            break;
+        }
+        if (gap_us > 0)
+            usleep(gap_us);
+    }
+
+    if (i > 0)
+    {
+        printf("%d rising edges\n", i);
+        if (print_dist("edge-to-isr", edge_to_isr, i) > max_p99_ns)
+        {
+            printf("edge-to-isr p99 above %llu ns\n", max_p99_ns);
+            ret = 1;
+        }
+        if (print_dist("isr-to-read", isr_to_read, i) > max_p99_ns)
+        {
+            printf("isr-to-read p99 above %llu ns\n", max_p99_ns);
+            ret = 1;
+        }
+    }
+    if (ioctl(fd, GPIO_LAT_STATS, &lat) == 0)
+    {
+        printf("isr-to-thread histogram:\n");
+        for (i = 0; i < GPIO_LAT_BUCKETS; i++)
+            if (lat.isr_to_thread[i] != 0)
+                printf("  < %10llu ns: %llu\n", 1ULL << i, lat.isr_to_thread[i]);
+    }
+    print_stats(fd);
+
+    free(edge_to_isr);
+    free(isr_to_read);
+    close(pull_fd);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Create a gpio-sim chip so gpio_workqueue can be tested on an x86 host.
+#
+#   ./gpio_sim.sh up [lines]   create chip "bbb-sim", load the module with
+#                              outputs 0,1 and inputs on the last two lines
+#   ./gpio_sim.sh bench [n]    run gpio_bench on the first input line
+#   ./gpio_sim.sh storm [n]    bounce the first input line n times
+#   ./gpio_sim.sh down         unload the module and remove the chip
+#
+# Needs CONFIG_GPIO_SIM and configfs, build with "make host bench" first.
+
+CFS=/sys/kernel/config/gpio-sim/bbb
+LABEL=bbb-sim
+LINES=${2:-8}
+
+pull_path() {
+	echo /sys/devices/platform/$(cat $CFS/dev_name)/$(cat $CFS/bank0/chip_name)/sim_gpio$1/pull
+}
+
+case "$1" in
+up)
+	modprobe gpio-sim || exit 1
+	mkdir -p $CFS/bank0 || exit 1
+	echo $LINES > $CFS/bank0/num_lines
+	echo $LABEL > $CFS/bank0/label
+	echo 1 > $CFS/live
+	insmod ./gpio_workqueue.ko chip_label=$LABEL out_gpios=0,1 \
+		in_gpios=$((LINES - 2)),$((LINES - 1)) blink_policy=3 || exit 1
+	echo "switch line: $(pull_path $((LINES - 2)))"
+	;;
+bench)
+	LINES=$(cat $CFS/bank0/num_lines)
+	./gpio_bench $(pull_path $((LINES - 2))) ${2:-1000}
+	;;
+storm)
+	LINES=$(cat $CFS/bank0/num_lines)
+	./gpio_bench $(pull_path $((LINES - 2))) storm ${2:-10000}
+	;;
+down)
+	rmmod gpio_workqueue
+	echo 0 > $CFS/live
+	rmdir $CFS/bank0 $CFS
+	;;
+*)
+	echo "usage: $0 up [lines] | bench [iterations] | storm [toggles] | down"
+	exit 2
+	;;
+esac
@@ -5,59 +5,540 @@
 #include<linux/init.h>
 #include<linux/uaccess.h>
 #include<linux/gpio.h>
+#include<linux/gpio/consumer.h>
+#include<linux/gpio/driver.h>
+#include<linux/gpio/machine.h>
+#include<linux/platform_device.h>
+#include<linux/of.h>
+#include<linux/slab.h>
+#include<linux/bitmap.h>
 #include<linux/interrupt.h>
-#include<linux/workqueue.h>
-#include<linux/delay.h>
+#include<linux/hrtimer.h>
+#include<linux/ktime.h>
+#include<linux/spinlock.h>
+#include<linux/kfifo.h>
+#include<linux/wait.h>
+#include<linux/poll.h>
+#include<linux/mutex.h>
+#include<linux/seqlock.h>
+#include<linux/mm.h>
+#include<linux/version.h>
+#include "bbb_gpio_ioctl.h"
 
 static int bbb_gpio_open(struct inode *, struct file *);
 static int bbb_gpio_close(struct inode *, struct file *);
 static ssize_t bbb_gpio_read(struct file *, char *, size_t, loff_t *);
 static ssize_t bbb_gpio_write(struct file *, const char *, size_t, loff_t *);
+static __poll_t bbb_gpio_poll(struct file *, poll_table *);
+static long bbb_gpio_ioctl(struct file *, unsigned int, unsigned long);
+static int bbb_gpio_mmap(struct file *, struct vm_area_struct *);
 
 #define LED_GPIO 49
 #define SWITCH_GPIO 115
+#define MAX_LINES GPIO_MAX_LINES
 
-static struct work_struct work_qu;
-static int led_state;
+// first output is the blink LED, first input is the blink switch
+static int out_gpios[MAX_LINES] = { LED_GPIO };
+static int n_out_gpios = 1;
+module_param_array(out_gpios, int, &n_out_gpios, 0444);
+MODULE_PARM_DESC(out_gpios, "output gpio numbers (line offsets if chip_label is set), first one is the blink LED");
+static int in_gpios[MAX_LINES] = { SWITCH_GPIO };
+static int n_in_gpios = 1;
+module_param_array(in_gpios, int, &n_in_gpios, 0444);
+MODULE_PARM_DESC(in_gpios, "input gpio numbers (line offsets if chip_label is set), first one is the blink switch");
+static char *chip_label = NULL;
+module_param(chip_label, charp, 0444);
+MODULE_PARM_DESC(chip_label, "take all lines from this gpio chip, e.g. a gpio-sim bank for testing without a board");
+static bool use_dt = false;
+module_param(use_dt, bool, 0444);
+MODULE_PARM_DESC(use_dt, "take out-gpios/in-gpios from a bbb,gpio-workqueue devicetree node instead of the params");
+
+// what a press does while a blink pattern is running
+#define BLINK_QUEUE   0 // run another pattern after the current one
+#define BLINK_EXTEND  1 // add blink_count toggles to the current one
+#define BLINK_RESTART 2 // start the current one over
+#define BLINK_IGNORE  3 // drop the press
+#define BLINK_MAX_QUEUED 16
+
+static unsigned int blink_ms = 1000;
+module_param(blink_ms, uint, 0644);
+MODULE_PARM_DESC(blink_ms, "time between LED toggles in ms");
+static unsigned int blink_count = 10;
+module_param(blink_count, uint, 0644);
+MODULE_PARM_DESC(blink_count, "LED toggles per switch press");
+static int blink_policy = BLINK_QUEUE;
+module_param(blink_policy, int, 0644);
+MODULE_PARM_DESC(blink_policy, "press while blinking: 0=queue, 1=extend, 2=restart, 3=ignore");
+
+static struct gpio_descs *outs;
+static struct gpio_descs *ins;
+static DECLARE_BITMAP(out_state, MAX_LINES); // last value driven on each output, bit 0 = LED
+// outputs on a sleeping chip (i2c expander, gpio-sim) are driven outside blink_lock
+static bool outs_cansleep;
+static DEFINE_MUTEX(out_io_lock); // orders sleeping writes of out_state
+static struct work_struct out_work; // blink_timer_fn toggles through this on sleeping chips
+
+static struct hrtimer blink_timer;
+static DEFINE_SPINLOCK(blink_lock); // protects out_state and blink state below
+static bool blink_running; // blink_timer armed
+static unsigned int blink_left; // toggles left in running pattern
+static unsigned int blink_queued; // patterns waiting behind the running one
+static unsigned long blink_dropped; // presses lost to the ignore policy or a full queue
+
+static unsigned int debounce_us = 0;
+module_param(debounce_us, uint, 0644);
+MODULE_PARM_DESC(debounce_us, "ignore switch edges closer than this to the previous one, 0 = off");
+
+// above storm_rate interrupts/s an input is masked and sampled every
+// storm_poll_us until its level stayed put for storm_quiet_ms. The rate is
+// checked as storm_rate/100 irqs per 10 ms window but never less than 2, so
+// anything below 200 behaves as 200
+static unsigned int storm_rate = 2000;
+module_param(storm_rate, uint, 0644);
+MODULE_PARM_DESC(storm_rate, "interrupts per second on one input that switch it to polling, 0 = never, values below 200 act as 200");
+static unsigned int storm_poll_us = 1000;
+module_param(storm_poll_us, uint, 0644);
+MODULE_PARM_DESC(storm_poll_us, "input sampling period while polling");
+static unsigned int storm_quiet_ms = 100;
+module_param(storm_quiet_ms, uint, 0644);
+MODULE_PARM_DESC(storm_quiet_ms, "back to interrupts after the input was stable this long");
+#define STORM_WINDOW_NS (10 * NSEC_PER_MSEC) // storm_rate is checked over this window
+
+struct bbb_input
+{
+	struct gpio_desc *desc;
+	int irq;
+	int index; // position in ins
+	u64 last_ns; // last accepted edge, for debounce
+	int value; // last level reported
+	bool cansleep; // level is read in switch_thread, irq is IRQF_ONESHOT
+	u64 isr_ns; // edge time switch_isr hands to switch_thread when cansleep, 0 = none
+	// storm mitigation, switch_isr and the poller never run at the same time
+	u64 win_ns; // start of the rate window
+	unsigned int win_irqs; // interrupts in it
+	u64 change_ns; // last level change seen by poll_timer
+	bool resync; // next irq may be the edge enable_irq() replays
+	bool stop; // remove in progress, poll_work must not rearm poll_timer
+	struct hrtimer poll_timer;
+	struct work_struct poll_work; // samples sleeping lines for poll_timer
+};
+static struct bbb_input *inputs;
+
+// filled by switch_isr under ev_lock, drained by readers under ev_read_lock
+#define EV_FIFO_SIZE 256
+static DECLARE_KFIFO(ev_fifo, gpio_event_t, EV_FIFO_SIZE);
+static DEFINE_SPINLOCK(ev_lock); // input irqs may fire on several cpus at once
+static DEFINE_MUTEX(ev_read_lock);
+static DECLARE_WAIT_QUEUE_HEAD(ev_wq);
+static atomic_t ev_presses; // blink switch rising edges not yet handed to blink_trigger
+static gpio_ev_stats_t ev_stats; // protected by ev_lock
+static atomic64_t ev_press_ns; // isr time of oldest press the thread hasn't seen, 0 = none
+static gpio_lat_t ev_lat; // protected by ev_lock
 static dev_t devno;
 static int major;
 static struct class *pclass;
 static struct cdev cdev;
-static int irq;
+
+// line states for readers that sample without locks or syscalls, one zeroed
+// page that user space can mmap; snap->seq mirrors snap_lock's sequence
+static DEFINE_SEQLOCK(snap_lock);
+static gpio_snapshot_t *snap;
+
+static struct gpiod_lookup_table *bbb_lookup;
+static struct platform_device *bbb_pdev;
+static bool bbb_probed;
 
 static struct file_operations bbb_gpio_fops = {
 	.owner = THIS_MODULE,
 	.open = bbb_gpio_open,
 	.release = bbb_gpio_close,
 	.read = bbb_gpio_read,
-	.write = bbb_gpio_write
+	.write = bbb_gpio_write,
+	.poll = bbb_gpio_poll,
+	.unlocked_ioctl = bbb_gpio_ioctl,
+	.mmap = bbb_gpio_mmap
 };
 
-static void workqueue_handler(struct work_struct *param){
-    int i;
-	printk(KERN_INFO"%s : workqueue_handler is called\n", THIS_MODULE->name);
-	for(i=0; i<10;i++){
-		led_state = !led_state;
-		gpio_set_value(LED_GPIO,led_state);
-		msleep(1000);
+static void snap_begin(unsigned long *flags){
+	write_seqlock_irqsave(&snap_lock, *flags);
+	WRITE_ONCE(snap->seq, snap->seq + 1);
+	smp_wmb();
+}
+
+static void snap_end(unsigned long *flags){
+	smp_wmb();
+	WRITE_ONCE(snap->seq, snap->seq + 1);
+	write_sequnlock_irqrestore(&snap_lock, *flags);
+}
+
+// caller is between snap_begin() and snap_end()
+static void snap_line(int line, int value, u64 ts_ns){
+	gpio_line_snap_t *l = &snap->line[line];
+
+	if(l->value == value)
+		return;
+	l->value = value;
+	l->ts_ns = ts_ns;
+	l->toggles++;
+}
+
+// drive out_state as it is now; may sleep, so never under blink_lock
+static void bbb_apply_outputs(void){
+	DECLARE_BITMAP(state, MAX_LINES);
+	unsigned long flags;
+
+	mutex_lock(&out_io_lock);
+	spin_lock_irqsave(&blink_lock, flags);
+	bitmap_copy(state, out_state, MAX_LINES);
+	spin_unlock_irqrestore(&blink_lock, flags);
+	gpiod_set_array_value_cansleep(outs->ndescs, outs->desc, outs->info, state);
+	mutex_unlock(&out_io_lock);
+}
+
+static void out_work_fn(struct work_struct *work){
+	bbb_apply_outputs();
+}
+
+// one toggle per expiry in hardirq context, sleeping LED chips are written from out_work
+static enum hrtimer_restart blink_timer_fn(struct hrtimer *timer)
+{
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	unsigned long flags, sflags;
+	bool toggled = false;
+
+	spin_lock_irqsave(&blink_lock, flags);
+	if(blink_left == 0 && blink_queued > 0){
+		blink_queued--;
+		blink_left = blink_count;
+	}
+	if(blink_left > 0){
+		__change_bit(0, out_state);
+		if(!outs_cansleep)
+			gpiod_set_value(outs->desc[0], test_bit(0, out_state));
+		toggled = true;
+		snap_begin(&sflags);
+		snap_line(0, test_bit(0, out_state), ktime_get_ns());
+		snap_end(&sflags);
+		blink_left--;
+		hrtimer_forward_now(timer, ms_to_ktime(max(blink_ms, 1U)));
+	}
+	else{
+		blink_running = false;
+		ret = HRTIMER_NORESTART;
+	}
+	spin_unlock_irqrestore(&blink_lock, flags);
+	if(toggled && outs_cansleep)
+		queue_work(system_highpri_wq, &out_work);
+	return ret;
+}
+
+static void blink_trigger(void){
+	unsigned long flags;
+	bool start = false;
+
+	spin_lock_irqsave(&blink_lock, flags);
+	if(!blink_running){
+		blink_running = true;
+		blink_left = blink_count;
+		start = true;
+	}
+	else{
+		switch(blink_policy){
+		case BLINK_QUEUE:
+			if(blink_queued < BLINK_MAX_QUEUED)
+				blink_queued++;
+			else
+				blink_dropped++;
+			break;
+		case BLINK_EXTEND:
+			blink_left += blink_count;
+			break;
+		case BLINK_RESTART:
+			blink_left = blink_count;
+			break;
+		default:
+			blink_dropped++;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&blink_lock, flags);
+	if(start)
+		hrtimer_start(&blink_timer, 0, HRTIMER_MODE_REL);
+}
+
+// drive any subset of outputs with one gpiod_set_array_value(), lines on the
+// same bank are written with a single register access; process context only
+static void bbb_set_outputs(u64 mask, u64 value){
+	DECLARE_BITMAP(bmask, MAX_LINES);
+	DECLARE_BITMAP(bvalue, MAX_LINES);
+	unsigned long flags, sflags, bit;
+	u64 now;
+
+	bitmap_from_u64(bmask, mask);
+	bitmap_from_u64(bvalue, value);
+	spin_lock_irqsave(&blink_lock, flags);
+	// explicit LED state ends any blink pattern, timer stops on next expiry
+	if(test_bit(0, bmask)){
+		blink_left = 0;
+		blink_queued = 0;
+	}
+	bitmap_replace(out_state, out_state, bvalue, bmask, outs->ndescs);
+	if(!outs_cansleep)
+		gpiod_set_array_value(outs->ndescs, outs->desc, outs->info, out_state);
+	now = ktime_get_ns();
+	snap_begin(&sflags);
+	for_each_set_bit(bit, bmask, outs->ndescs)
+		snap_line(bit, test_bit(bit, out_state), now);
+	snap_end(&sflags);
+	spin_unlock_irqrestore(&blink_lock, flags);
+	if(outs_cansleep)
+		bbb_apply_outputs();
+}
+
+static u64 bbb_bitmap_to_u64(const unsigned long *bits, unsigned int nbits){
+	unsigned int bit;
+	u64 val = 0;
+
+	for_each_set_bit(bit, bits, nbits)
+		val |= 1ULL << bit;
+	return val;
+}
+
+// queue an input level for readers, true if the blink thread has a press to handle
+static bool bbb_input_edge(struct bbb_input *in, int value, u64 ts_ns){
+	gpio_event_t ev;
+	unsigned long flags, sflags;
+	bool queued;
+
+	ev.ts_ns = ts_ns;
+	ev.gpio = desc_to_gpio(in->desc);
+	ev.edge = value;
+	in->value = value;
+	snap_begin(&sflags);
+	snap_line(outs->ndescs + in->index, ev.edge, ev.ts_ns);
+	snap_end(&sflags);
+
+	// switch_thread of a sleeping input gets here too
+	spin_lock_irqsave(&ev_lock, flags);
+	queued = kfifo_put(&ev_fifo, ev);
+	if(queued)
+		ev_stats.events++;
+	else
+		ev_stats.overflow++;
+	spin_unlock_irqrestore(&ev_lock, flags);
+	wake_up_interruptible(&ev_wq);
+
+	// only the first input drives the blink pattern
+	if(in->index != 0 || !ev.edge)
+		return false;
+	atomic_inc(&ev_presses);
+	atomic64_cmpxchg(&ev_press_ns, 0, ev.ts_ns);
+	return true;
+}
+
+// level read after an irq, true if the blink thread has a press to handle
+static bool bbb_input_level(struct bbb_input *in, int value, u64 ts_ns){
+	if(in->resync){
+		in->resync = false;
+		if(value == in->value)
+			return false;
 	}
-    printk(KERN_INFO"%s : workqueue_handler is completed\n", THIS_MODULE->name);
+	return bbb_input_edge(in, value, ts_ns);
 }
 
+// more than storm_rate interrupts/s in the current window, caller holds ev_lock
+static bool bbb_storm_check(struct bbb_input *in, u64 now){
+	unsigned int rate = READ_ONCE(storm_rate);
+
+	if(rate == 0)
+		return false;
+	if(now - in->win_ns >= STORM_WINDOW_NS){
+		in->win_ns = now;
+		in->win_irqs = 0;
+	}
+	return ++in->win_irqs > max(rate / (unsigned int)(NSEC_PER_SEC / STORM_WINDOW_NS), 2U);
+}
+
+// hard irq half: timestamp and queue the edge, everything else goes to the thread
 static irqreturn_t switch_isr(int irq, void *param){
+	struct bbb_input *in = param;
+	u64 now = ktime_get_ns();
+	bool storm;
+
+	spin_lock(&ev_lock);
+	ev_stats.irqs++;
+	storm = bbb_storm_check(in, now);
+	if(storm)
+		ev_stats.storms++;
+	spin_unlock(&ev_lock);
+	if(storm){
+		// poll_timer takes over the line till it calms down, this edge is still reported
+		disable_irq_nosync(irq);
+		in->change_ns = now;
+		hrtimer_start(&in->poll_timer, us_to_ktime(max(storm_poll_us, 1U)), HRTIMER_MODE_REL);
+		printk(KERN_INFO"%s : irq storm on GPIO pin %d, polling\n", THIS_MODULE->name, desc_to_gpio(in->desc));
+		// a sleeping line is left to the poller, its first sample reports this edge
+		if(in->cansleep)
+			return IRQ_HANDLED;
+	}
 
-	printk(KERN_INFO"%s : switch_isr() is called\n", THIS_MODULE->name);
-	schedule_work(&work_qu);	
-    return IRQ_HANDLED;
+	if(debounce_us != 0 && now - in->last_ns < (u64)debounce_us * NSEC_PER_USEC){
+		spin_lock(&ev_lock);
+		ev_stats.debounced++;
+		spin_unlock(&ev_lock);
+		return IRQ_HANDLED;
+	}
+	in->last_ns = now;
+	if(in->cansleep){
+		// IRQF_ONESHOT keeps the line masked till switch_thread has read it
+		in->isr_ns = now;
+		return IRQ_WAKE_THREAD;
+	}
+	return bbb_input_level(in, gpiod_get_value(in->desc) ? 1 : 0, now) ? IRQ_WAKE_THREAD : IRQ_HANDLED;
 }
 
-static __init int bbb_gpio_init(void){
-	
-	int ret,minor;
+/*
+ * Storm mode of one input. Every level change between two samples becomes
+ * one event, so bounce is folded away while presses longer than
+ * storm_poll_us still get through. Returns false once the input has been
+ * quiet for storm_quiet_ms and its irq is enabled again.
+ */
+static bool storm_sample(struct bbb_input *in, int value, u64 now){
+	unsigned long flags;
+
+	if(value != in->value){
+		in->change_ns = now;
+		spin_lock_irqsave(&ev_lock, flags);
+		ev_stats.coalesced++;
+		spin_unlock_irqrestore(&ev_lock, flags);
+		if(bbb_input_edge(in, value, now))
+			irq_wake_thread(in->irq, in);
+	}
+	if(now - in->change_ns < (u64)storm_quiet_ms * NSEC_PER_MSEC)
+		return true;
+
+	spin_lock_irqsave(&ev_lock, flags);
+	ev_stats.calms++;
+	spin_unlock_irqrestore(&ev_lock, flags);
+	in->win_ns = now;
+	in->win_irqs = 0;
+	in->resync = true;
+	enable_irq(in->irq);
+	printk(KERN_INFO"%s : GPIO pin %d calm, back to irq\n", THIS_MODULE->name, desc_to_gpio(in->desc));
+	return false;
+}
+
+// hardirq sampling, a sleeping line is handed over to poll_work
+static enum hrtimer_restart storm_poll_fn(struct hrtimer *timer){
+	struct bbb_input *in = container_of(timer, struct bbb_input, poll_timer);
+
+	if(in->cansleep){
+		queue_work(system_highpri_wq, &in->poll_work);
+		return HRTIMER_NORESTART;
+	}
+	if(!storm_sample(in, gpiod_get_value(in->desc) ? 1 : 0, ktime_get_ns()))
+		return HRTIMER_NORESTART;
+	hrtimer_forward_now(timer, us_to_ktime(max(storm_poll_us, 1U)));
+	return HRTIMER_RESTART;
+}
+
+static void storm_poll_work(struct work_struct *work){
+	struct bbb_input *in = container_of(work, struct bbb_input, poll_work);
+	int value = gpiod_get_value_cansleep(in->desc) ? 1 : 0;
+
+	if(storm_sample(in, value, ktime_get_ns()) && !READ_ONCE(in->stop))
+		hrtimer_start(&in->poll_timer, us_to_ktime(max(storm_poll_us, 1U)), HRTIMER_MODE_REL);
+}
+
+// no isr can start poll_timer again once the line is disabled
+static void bbb_input_release(struct bbb_input *in){
+	disable_irq(in->irq);
+	WRITE_ONCE(in->stop, true);
+	hrtimer_cancel(&in->poll_timer);
+	cancel_work_sync(&in->poll_work);
+	// poll_work may have rearmed the timer before it saw stop
+	hrtimer_cancel(&in->poll_timer);
+	cancel_work_sync(&in->poll_work);
+	free_irq(in->irq, in);
+}
+
+static irqreturn_t switch_thread(int irq, void *param){
+	struct bbb_input *in = param;
+	u64 edge_ns = xchg(&in->isr_ns, 0);
+	unsigned long flags;
+	u64 isr_ns;
+	int presses;
+
+	// poller wakeups come without an edge of their own
+	if(edge_ns != 0)
+		bbb_input_level(in, gpiod_get_value_cansleep(in->desc) ? 1 : 0, edge_ns);
+	isr_ns = atomic64_xchg(&ev_press_ns, 0);
+	presses = atomic_xchg(&ev_presses, 0);
+
+	if(isr_ns != 0){
+		spin_lock_irqsave(&ev_lock, flags);
+		ev_lat.isr_to_thread[min(fls64(ktime_get_ns() - isr_ns), GPIO_LAT_BUCKETS - 1)]++;
+		spin_unlock_irqrestore(&ev_lock, flags);
+	}
+
+	printk(KERN_INFO"%s : switch_thread() handling %d press(es)\n", THIS_MODULE->name, presses);
+	while(presses-- > 0)
+		blink_trigger();
+	return IRQ_HANDLED;
+}
+
+static int bbb_gpio_probe(struct platform_device *plat){
+	struct device *dev = &plat->dev;
+	DECLARE_BITMAP(in_state, MAX_LINES);
+	int ret,minor,i;
 	struct device *pdevice;
 
-	printk(KERN_INFO "%s : bbb_gpio_init() is called\n",THIS_MODULE->name);
-	
+	printk(KERN_INFO "%s : bbb_gpio_probe() is called\n",THIS_MODULE->name);
+
+	outs = devm_gpiod_get_array(dev, "out", GPIOD_OUT_LOW);
+	if(IS_ERR(outs)){
+		printk(KERN_ERR"%s : output gpios not available\n", THIS_MODULE->name);
+		return PTR_ERR(outs);
+	}
+	ins = devm_gpiod_get_array(dev, "in", GPIOD_IN);
+	if(IS_ERR(ins)){
+		printk(KERN_ERR"%s : input gpios not available\n", THIS_MODULE->name);
+		return PTR_ERR(ins);
+	}
+	if(outs->ndescs > MAX_LINES || ins->ndescs > MAX_LINES){
+		printk(KERN_ERR"%s : more than %d lines\n", THIS_MODULE->name, MAX_LINES);
+		return -EINVAL;
+	}
+	printk(KERN_INFO"%s : %u outputs, %u inputs acquired\n", THIS_MODULE->name, outs->ndescs, ins->ndescs);
+
+	inputs = devm_kcalloc(dev, ins->ndescs, sizeof(struct bbb_input), GFP_KERNEL);
+	if(inputs == NULL)
+		return -ENOMEM;
+
+	snap = (gpio_snapshot_t*)get_zeroed_page(GFP_KERNEL);
+	if(snap == NULL)
+		return -ENOMEM;
+	snap->n_outputs = outs->ndescs;
+	snap->n_inputs = ins->ndescs;
+	for(i = 0; i < outs->ndescs; i++)
+		snap->line[i].gpio = desc_to_gpio(outs->desc[i]);
+	bitmap_zero(in_state, MAX_LINES);
+	gpiod_get_array_value_cansleep(ins->ndescs, ins->desc, ins->info, in_state);
+	for(i = 0; i < ins->ndescs; i++){
+		snap->line[outs->ndescs + i].gpio = desc_to_gpio(ins->desc[i]);
+		snap->line[outs->ndescs + i].value = test_bit(i, in_state);
+	}
+
+	// LED starts on, like before
+	bitmap_zero(out_state, MAX_LINES);
+	__set_bit(0, out_state);
+	outs_cansleep = false;
+	for(i = 0; i < outs->ndescs; i++)
+		outs_cansleep |= gpiod_cansleep(outs->desc[i]);
+	INIT_WORK(&out_work, out_work_fn);
+	gpiod_set_array_value_cansleep(outs->ndescs, outs->desc, outs->info, out_state);
+	snap->line[0].value = 1;
+
 	ret = alloc_chrdev_region(&devno,0,1,"bbb_gpio");
 	if(ret < 0){
 		printk(KERN_ERR "%s :alloc_chrdev_region failed\n", THIS_MODULE->name);
@@ -90,69 +571,43 @@ static __init int bbb_gpio_init(void){
 		goto cdev_add_failed;
 	}
 
-	bool valid = gpio_is_valid(LED_GPIO);
-	if(!valid){
-		printk(KERN_ERR"%s : GPIO pin %d doesn't exit.\n",THIS_MODULE->name,LED_GPIO);
-		ret = -1;
-		goto gpio_invalid;
-	}
-	printk(KERN_INFO"%s : GPIO pin %d exits\n",THIS_MODULE->name, LED_GPIO);
-
-	ret = gpio_request(LED_GPIO,"bbb_led");
-	if(ret != 0){
-		printk(KERN_INFO"%s : GPIO pin %d is busy\n", THIS_MODULE->name,LED_GPIO);
-		goto gpio_invalid;
-	}
-
-	led_state=1;
-	ret = gpio_direction_output(LED_GPIO,led_state);
-	if(ret != 0){
-		printk(KERN_ERR"%s : GPIO pin %d direction not set\n",THIS_MODULE->name,LED_GPIO);
-		goto gpio_direction_failed;
-	}
-	printk(KERN_INFO"%s : GPIO pin %d direction set to output\n",THIS_MODULE->name,LED_GPIO);
-	
-	valid = gpio_is_valid(SWITCH_GPIO);
-	if(!valid){
-		printk(KERN_INFO"%s : GPIO pin %d dosen't exits\n", THIS_MODULE->name,SWITCH_GPIO);
-		ret = -1;
-		goto switch_gpio_invalid;
-	}
-
-	ret = gpio_request(SWITCH_GPIO,"bbb_switch");
-	if(ret != 0){
-		printk(KERN_INFO"%s : GPIO pin %d is busy\n", THIS_MODULE->name,SWITCH_GPIO);
-		goto switch_gpio_invalid;
-	}
-	printk(KERN_INFO"%s : GPIO pin %d exits\n",THIS_MODULE->name, SWITCH_GPIO);
+	hrtimer_init(&blink_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	blink_timer.function = blink_timer_fn;
 
-	ret = gpio_direction_input(SWITCH_GPIO);
-	if(ret != 0){
-		printk(KERN_ERR"%s : gpio pin %d direction can't set\n",THIS_MODULE->name,SWITCH_GPIO );
-		goto switch_gpio_invalid;
-	}
-	printk(KERN_INFO"%s : GPIO pin %d direction set to input\n",THIS_MODULE->name,SWITCH_GPIO);
+	INIT_KFIFO(ev_fifo);
 
-	irq = gpio_to_irq(SWITCH_GPIO);
-	ret = request_irq(irq,switch_isr,IRQF_TRIGGER_RISING, "bbb_switch",NULL);
-	if(ret != 0){
-		printk(KERN_INFO"%s : GPIO pin %d  ISR registration  failed\n", THIS_MODULE->name,SWITCH_GPIO);
-		goto switch_gpio_direction_failed;
+	for(i = 0; i < ins->ndescs; i++){
+		inputs[i].desc = ins->desc[i];
+		inputs[i].index = i;
+		inputs[i].value = test_bit(i, in_state);
+		inputs[i].cansleep = gpiod_cansleep(inputs[i].desc);
+		hrtimer_init(&inputs[i].poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		inputs[i].poll_timer.function = storm_poll_fn;
+		INIT_WORK(&inputs[i].poll_work, storm_poll_work);
+		inputs[i].irq = gpiod_to_irq(inputs[i].desc);
+		if(inputs[i].irq < 0){
+			printk(KERN_ERR"%s : GPIO pin %d has no irq\n", THIS_MODULE->name,desc_to_gpio(inputs[i].desc));
+			ret = inputs[i].irq;
+			goto request_irq_failed;
+		}
+		ret = request_threaded_irq(inputs[i].irq,switch_isr,switch_thread,IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING | (inputs[i].cansleep ? IRQF_ONESHOT : 0), "bbb_switch",&inputs[i]);
+		if(ret != 0){
+			printk(KERN_INFO"%s : GPIO pin %d  ISR registration  failed\n", THIS_MODULE->name,desc_to_gpio(inputs[i].desc));
+			goto request_irq_failed;
+		}
+		printk(KERN_INFO"%s : GPIO pin %d registerd ISR on irq line %d\n",THIS_MODULE->name,desc_to_gpio(inputs[i].desc),inputs[i].irq);
 	}
-	printk(KERN_INFO"%s : GPIO pin %d registerd ISR on irq line %d\n",THIS_MODULE->name,SWITCH_GPIO,irq);
-
-    //initialize workqueue
-	INIT_WORK(&work_qu,workqueue_handler);
 
+	bbb_probed = true;
 	return 0;
 
-switch_gpio_direction_failed:
-    gpio_free(SWITCH_GPIO);
-switch_gpio_invalid:
-gpio_direction_failed:
-    gpio_free(LED_GPIO);
-gpio_invalid:
-    cdev_del(&cdev);
+request_irq_failed:
+	while(--i >= 0)
+		bbb_input_release(&inputs[i]);
+	// a press on an input registered above may have started a blink
+	hrtimer_cancel(&blink_timer);
+	cancel_work_sync(&out_work);
+	cdev_del(&cdev);
 cdev_add_failed:
 	device_destroy(pclass, devno);
 device_create_failed:
@@ -160,19 +615,21 @@ device_create_failed:
 class_create_failed:
 	unregister_chrdev_region(devno, 1);
 alloc_chrdev_failed:
+	free_page((unsigned long)snap);
 	return ret;
 
 }
 
-static __exit void bbb_gpio_exit(void){
-	
-	printk(KERN_INFO"%s : bbb_gpio_exit() is called\n", THIS_MODULE->name);
-    free_irq(irq, NULL);
-    printk(KERN_INFO "%s: GPIO pin %d ISR released.\n", THIS_MODULE->name, SWITCH_GPIO);
-	gpio_free(LED_GPIO);
-	printk(KERN_INFO"%s : GPIO pin %d released\n", THIS_MODULE->name,LED_GPIO);
-	gpio_free(SWITCH_GPIO);
-	printk(KERN_INFO"%s : GPIO pin %d released\n", THIS_MODULE->name,SWITCH_GPIO);
+static int bbb_gpio_remove(struct platform_device *plat){
+	int i;
+
+	printk(KERN_INFO"%s : bbb_gpio_remove() is called\n", THIS_MODULE->name);
+	for(i = ins->ndescs - 1; i >= 0; i--)
+		bbb_input_release(&inputs[i]);
+	printk(KERN_INFO "%s: %u input ISRs released.\n", THIS_MODULE->name, ins->ndescs);
+	hrtimer_cancel(&blink_timer);
+	cancel_work_sync(&out_work);
+	printk(KERN_INFO "%s : blink timer stopped, %lu presses dropped\n", THIS_MODULE->name, blink_dropped);
 	cdev_del(&cdev);
 	printk(KERN_INFO" %s : cdev_del() is called\n", THIS_MODULE->name);
 	device_destroy(pclass, devno);
@@ -181,7 +638,140 @@ static __exit void bbb_gpio_exit(void){
 	printk(KERN_INFO "%s : class_destroy is called\n", THIS_MODULE->name);
 	unregister_chrdev_region(devno, 1);
 	printk(KERN_INFO "%s : unregister_chrdev_region is called\n",THIS_MODULE->name);
-	
+	// pages still mapped by readers keep their own reference
+	free_page((unsigned long)snap);
+	// gpio arrays and inputs are devm managed, released after this returns
+	bbb_probed = false;
+	return 0;
+}
+
+static const struct of_device_id bbb_gpio_of_match[] = {
+	{ .compatible = "bbb,gpio-workqueue" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, bbb_gpio_of_match);
+
+static struct platform_driver bbb_gpio_driver = {
+	.probe = bbb_gpio_probe,
+	.remove = bbb_gpio_remove,
+	.driver = {
+		.name = "bbb_gpio",
+		.of_match_table = bbb_gpio_of_match,
+	},
+};
+
+// describe a global gpio number as chip label + offset for the lookup table
+static int bbb_lookup_entry(struct gpiod_lookup *entry, int gpio, const char *con_id, int idx){
+	struct gpio_desc *desc;
+	struct gpio_chip *chip;
+
+	entry->con_id = con_id;
+	entry->idx = idx;
+	entry->flags = GPIO_ACTIVE_HIGH;
+	// offsets on a named chip, checked by gpiod_get_array() at probe
+	if(chip_label != NULL){
+		if(gpio < 0)
+			return -EINVAL;
+		entry->key = chip_label;
+		entry->chip_hwnum = gpio;
+		return 0;
+	}
+	if(!gpio_is_valid(gpio))
+		return -EINVAL;
+	desc = gpio_to_desc(gpio);
+	if(desc == NULL)
+		return -EINVAL;
+	chip = gpiod_to_chip(desc);
+	entry->key = chip->label;
+	entry->chip_hwnum = gpio - chip->base;
+	return 0;
+}
+
+static int bbb_lookup_create(void){
+	int i, n = 0, ret;
+
+	// zeroed last entry terminates the table
+	bbb_lookup = kzalloc(struct_size(bbb_lookup, table, n_out_gpios + n_in_gpios + 1), GFP_KERNEL);
+	if(bbb_lookup == NULL)
+		return -ENOMEM;
+	bbb_lookup->dev_id = "bbb_gpio";
+	for(i = 0; i < n_out_gpios; i++){
+		ret = bbb_lookup_entry(&bbb_lookup->table[n++], out_gpios[i], "out", i);
+		if(ret != 0){
+			printk(KERN_ERR"%s : GPIO pin %d doesn't exit.\n",THIS_MODULE->name,out_gpios[i]);
+			goto entry_failed;
+		}
+	}
+	for(i = 0; i < n_in_gpios; i++){
+		ret = bbb_lookup_entry(&bbb_lookup->table[n++], in_gpios[i], "in", i);
+		if(ret != 0){
+			printk(KERN_ERR"%s : GPIO pin %d doesn't exit.\n",THIS_MODULE->name,in_gpios[i]);
+			goto entry_failed;
+		}
+	}
+	gpiod_add_lookup_table(bbb_lookup);
+	return 0;
+
+entry_failed:
+	kfree(bbb_lookup);
+	return ret;
+}
+
+static __init int bbb_gpio_init(void){
+	int ret;
+
+	printk(KERN_INFO "%s : bbb_gpio_init() is called\n",THIS_MODULE->name);
+
+	ret = platform_driver_register(&bbb_gpio_driver);
+	if(ret != 0){
+		printk(KERN_ERR"%s : platform_driver_register() failed\n", THIS_MODULE->name);
+		return ret;
+	}
+	// devicetree node binds the driver by itself
+	if(use_dt)
+		return 0;
+
+	if(n_out_gpios < 1 || n_in_gpios < 1){
+		ret = -EINVAL;
+		goto lookup_failed;
+	}
+	ret = bbb_lookup_create();
+	if(ret != 0)
+		goto lookup_failed;
+
+	bbb_pdev = platform_device_register_simple("bbb_gpio", PLATFORM_DEVID_NONE, NULL, 0);
+	if(IS_ERR(bbb_pdev)){
+		printk(KERN_ERR"%s : platform_device_register_simple() failed\n", THIS_MODULE->name);
+		ret = PTR_ERR(bbb_pdev);
+		goto pdev_failed;
+	}
+	// probe runs synchronously, fail the load rather than sit unbound
+	if(!bbb_probed){
+		printk(KERN_ERR"%s : probe failed, check out_gpios/in_gpios\n", THIS_MODULE->name);
+		ret = -ENODEV;
+		goto probe_failed;
+	}
+	return 0;
+
+probe_failed:
+	platform_device_unregister(bbb_pdev);
+pdev_failed:
+	gpiod_remove_lookup_table(bbb_lookup);
+	kfree(bbb_lookup);
+lookup_failed:
+	platform_driver_unregister(&bbb_gpio_driver);
+	return ret;
+}
+
+static __exit void bbb_gpio_exit(void){
+
+	printk(KERN_INFO"%s : bbb_gpio_exit() is called\n", THIS_MODULE->name);
+	if(!use_dt){
+		platform_device_unregister(bbb_pdev);
+		gpiod_remove_lookup_table(bbb_lookup);
+		kfree(bbb_lookup);
+	}
+	platform_driver_unregister(&bbb_gpio_driver);
 }
 
 static int bbb_gpio_open(struct inode *pinode, struct file *pfile){
@@ -194,35 +784,133 @@ static int bbb_gpio_close(struct inode *pinode, struct file *pfile){
 	return 0;
 }
 
+// blocks till switch events arrive, returns as many whole gpio_event_t as fit
 static ssize_t bbb_gpio_read(struct file *pfile, char *ubuf, size_t size, loff_t *poffset){
-	int ret,switch_state;
-	char kbuf[4];
-	switch_state = gpio_get_value(SWITCH_GPIO);
-	printk(KERN_INFO"%s : bbb_gpio_read is called\n", THIS_MODULE->name);
-	sprintf(kbuf,"%d\n",led_state);
-	ret = 2 - copy_to_user(ubuf,kbuf,2);
-	printk(KERN_INFO"%s : GPIO pin %d LED state read = %d\n", THIS_MODULE->name,LED_GPIO,led_state);
-	return size;
+	unsigned int copied;
+	int ret;
+
+	if(size < sizeof(gpio_event_t))
+		return -EINVAL;
+	while(1){
+		if((pfile->f_flags & O_NONBLOCK) && kfifo_is_empty(&ev_fifo))
+			return -EAGAIN;
+		ret = wait_event_interruptible(ev_wq, !kfifo_is_empty(&ev_fifo));
+		if(ret != 0)
+			return -ERESTARTSYS;
+
+		mutex_lock(&ev_read_lock);
+		ret = kfifo_to_user(&ev_fifo, ubuf, size - size % sizeof(gpio_event_t), &copied);
+		mutex_unlock(&ev_read_lock);
+		if(ret < 0)
+			return ret;
+		// another reader may have taken the events
+		if(copied != 0)
+			return copied;
+	}
 }
 
-static ssize_t bbb_gpio_write(struct file *pfile, const char *ubuf, size_t size, loff_t *poffset){
+static __poll_t bbb_gpio_poll(struct file *pfile, poll_table *wait){
+	poll_wait(pfile, &ev_wq, wait);
+	return kfifo_is_empty(&ev_fifo) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+static long bbb_gpio_ioctl(struct file *pfile, unsigned int cmd, unsigned long param){
+	DECLARE_BITMAP(in_state, MAX_LINES);
+	gpio_ev_stats_t stats;
+	gpio_lat_t lat;
+	gpio_out_t out;
+	gpio_lines_t lines;
+	unsigned long flags;
+	unsigned int seq;
 	int ret;
-	char kbuf[2]="";
+
+	switch(cmd){
+	case GPIO_EV_STATS:
+		spin_lock_irqsave(&ev_lock, flags);
+		stats = ev_stats;
+		spin_unlock_irqrestore(&ev_lock, flags);
+		if(copy_to_user((void*)param, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	case GPIO_SET_OUTPUTS:
+		if(copy_from_user(&out, (void*)param, sizeof(out)))
+			return -EFAULT;
+		bbb_set_outputs(out.mask, out.value);
+		return 0;
+	case GPIO_GET_LINES:
+		// inputs sharing a bank come back from one register read
+		ret = gpiod_get_array_value_cansleep(ins->ndescs, ins->desc, ins->info, in_state);
+		if(ret < 0)
+			return ret;
+		lines.n_outputs = outs->ndescs;
+		lines.n_inputs = ins->ndescs;
+		spin_lock_irqsave(&blink_lock, flags);
+		lines.outputs = bbb_bitmap_to_u64(out_state, outs->ndescs);
+		spin_unlock_irqrestore(&blink_lock, flags);
+		lines.inputs = bbb_bitmap_to_u64(in_state, ins->ndescs);
+		if(copy_to_user((void*)param, &lines, sizeof(lines)))
+			return -EFAULT;
+		return 0;
+	case GPIO_LAT_STATS:
+		spin_lock_irqsave(&ev_lock, flags);
+		lat = ev_lat;
+		spin_unlock_irqrestore(&ev_lock, flags);
+		if(copy_to_user((void*)param, &lat, sizeof(lat)))
+			return -EFAULT;
+		return 0;
+	case GPIO_SNAPSHOT:
+		// lockless, copy again if a writer got in between
+		do{
+			seq = read_seqbegin(&snap_lock);
+			if(copy_to_user((void*)param, snap, sizeof(*snap)))
+				return -EFAULT;
+		}while(read_seqretry(&snap_lock, seq));
+		return 0;
+	case GPIO_LAT_RESET:
+		spin_lock_irqsave(&ev_lock, flags);
+		memset(&ev_lat, 0, sizeof(ev_lat));
+		memset(&ev_stats, 0, sizeof(ev_stats));
+		spin_unlock_irqrestore(&ev_lock, flags);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+// read only view of the snapshot page, see gpio_snapshot_t for the read protocol
+static int bbb_gpio_mmap(struct file *pfile, struct vm_area_struct *vma){
+	if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	// no mprotect() to writable later; vm_flags became read only in 6.3
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(snap));
+}
+
+// "0"/"1" sets the LED, "<mask> <value>" in hex sets any subset of outputs at once
+static ssize_t bbb_gpio_write(struct file *pfile, const char *ubuf, size_t size, loff_t *poffset){
+	char kbuf[40];
+	size_t len = min(size, sizeof(kbuf) - 1);
+	unsigned long long mask, value;
+
 	printk(KERN_INFO"%s : bbb_gpio_write is called\n",THIS_MODULE->name);
-	ret = 1 - copy_from_user(kbuf,ubuf,1);
-	if(ret > 0){
-		if(kbuf[0] == '1'){
-			led_state = 1;
-			gpio_set_value(LED_GPIO,led_state);
-		}
-		else if(kbuf[0] == '0'){
-			led_state = 0;
-			gpio_set_value(LED_GPIO,led_state);
-		}
-		else{
-			printk(KERN_INFO"%s : invalid argument\n", THIS_MODULE->name);
-		}
+	if(copy_from_user(kbuf,ubuf,len))
+		return -EFAULT;
+	kbuf[len] = '\0';
+	if((kbuf[0] == '1' || kbuf[0] == '0') && (kbuf[1] == '\0' || kbuf[1] == '\n')){
+		mask = 1;
+		value = kbuf[0] - '0';
+	}
+	else if(sscanf(kbuf, "%llx %llx", &mask, &value) != 2){
+		printk(KERN_INFO"%s : invalid argument\n", THIS_MODULE->name);
+		return size;
 	}
+	bbb_set_outputs(mask, value);
 	printk(KERN_INFO"%s : bbb_gpio_write() closed\n", THIS_MODULE->name);
 	return size;
 }
@@ -232,4 +920,4 @@ module_exit(bbb_gpio_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("PARTH");
-MODULE_DESCRIPTION("This is BBB GPIO tasklet");
\ No newline at end of file
+MODULE_DESCRIPTION("This is BBB GPIO tasklet");
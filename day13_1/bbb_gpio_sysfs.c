@@ -4,6 +4,14 @@
 #include<linux/module.h>
 #include<linux/init.h>
 #include <linux/gpio.h>
+#include <linux/gpio/driver.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+#include <linux/bitmap.h>
+#include <linux/slab.h>
 
 /*
  * This module shows how to create a simple subdirectory in sysfs called
@@ -12,6 +20,52 @@
 
 #define LED_GPIO    49
 static int led_state;
+static DEFINE_SPINLOCK(led_lock); // protects led_state, bank_state and the change tracking below
+static unsigned long led_changes;
+static u64 led_change_ns; // CLOCK_MONOTONIC time of the last change
+static struct kobject *led_kobj;
+
+/*
+ * Software PWM/blink engine. With pattern empty the LED is on for duty %
+ * of every period_us, otherwise each pattern char ('0'/'1') lasts period_us
+ * and the pattern loops. period_us = 0 stops the engine.
+ */
+#define PWM_PATTERN_MAX 64
+static DEFINE_MUTEX(pwm_mutex); // serializes engine reconfiguration
+static struct hrtimer pwm_timer;
+static unsigned int pwm_period_us; // 0 = engine off
+static unsigned int pwm_duty = 50; // percent
+static char pwm_pattern[PWM_PATTERN_MAX + 1];
+// below protected by led_lock
+static bool pwm_running;
+static int pwm_level;
+static unsigned int pwm_step;
+static u64 pwm_on_ns, pwm_off_ns;
+static u64 pwm_edges, pwm_missed; // edges done, edges skipped because the timer was too late
+static s64 pwm_jitter_min, pwm_jitter_max, pwm_jitter_sum; // expiry lateness in ns
+
+// bank of output lines, bit n of bank is led_gpios[n], line 0 is led_state
+#define BANK_MAX 32
+static int led_gpios[BANK_MAX] = { LED_GPIO };
+static int n_led_gpios = 1;
+module_param_array(led_gpios, int, &n_led_gpios, 0444);
+MODULE_PARM_DESC(led_gpios, "LED gpio numbers (line offsets if chip_label is set), first one is led_state");
+static char *chip_label = NULL;
+module_param(chip_label, charp, 0444);
+MODULE_PARM_DESC(chip_label, "gpio chip the LED lines are on, e.g. a gpio-sim bank for testing without a board");
+static int led_gpio; // led_gpios[0] as a global gpio number
+static struct gpio_desc *bank_desc[BANK_MAX];
+static DECLARE_BITMAP(bank_state, BANK_MAX);
+// a sleeping chip (gpio-sim, i2c expander) is written outside led_lock
+static bool bank_cansleep;
+static DEFINE_MUTEX(bank_io_lock); // keeps those writes in bank_state order
+
+// lines/line<n> attributes, built at init for the configured bank
+static struct kobj_attribute *line_attrs;
+static struct attribute **line_attr_list;
+static struct attribute_group line_group = {
+    .name = "lines",
+};
 /*
  * The "state" file where a static variable is read from and written to.
  */
@@ -20,27 +74,304 @@ static ssize_t led_state_show(struct kobject *kobj, struct kobj_attribute *attr,
     return sprintf(buf,"%d\n", led_state);
 }
 
+/*
+ * Every line change goes through here, process context only. The whole bank
+ * is written with one gpiod_set_array_value(), so lines of the same chip cost
+ * a single register write. poll()/select() for POLLPRI on led_state wakes up only when line 0
+ * really changed.
+ */
+static void bank_set(unsigned long mask, unsigned long value){
+    DECLARE_BITMAP(state, BANK_MAX);
+    unsigned long flags;
+    bool changed;
+
+    if(bank_cansleep)
+        mutex_lock(&bank_io_lock);
+    spin_lock_irqsave(&led_lock, flags);
+    bitmap_replace(bank_state, bank_state, &value, &mask, n_led_gpios);
+    if(!bank_cansleep)
+        gpiod_set_array_value(n_led_gpios, bank_desc, NULL, bank_state);
+    bitmap_copy(state, bank_state, BANK_MAX);
+    changed = (mask & 1) && led_state != test_bit(0, bank_state);
+    if(changed) {
+        led_state = test_bit(0, bank_state);
+        led_changes++;
+        led_change_ns = ktime_get_ns();
+    }
+    spin_unlock_irqrestore(&led_lock, flags);
+    if(bank_cansleep) {
+        gpiod_set_array_value_cansleep(n_led_gpios, bank_desc, NULL, state);
+        mutex_unlock(&bank_io_lock);
+    }
+
+    if(changed)
+        sysfs_notify(led_kobj, "my_attr", "led_state");
+}
+
+static void led_set(int state){
+    bank_set(1, state);
+}
+
+// one edge per expiry, hardirq context so the LED gpio must not sleep
+static enum hrtimer_restart pwm_timer_fn(struct hrtimer *timer){
+    s64 late = ktime_to_ns(ktime_sub(ktime_get(), hrtimer_get_expires(timer)));
+    u64 next_ns, overruns;
+
+    spin_lock(&led_lock);
+    if(!pwm_running) {
+        spin_unlock(&led_lock);
+        return HRTIMER_NORESTART;
+    }
+    if(pwm_pattern[0] != '\0') {
+        pwm_level = pwm_pattern[pwm_step] == '1';
+        pwm_step = pwm_pattern[pwm_step + 1] != '\0' ? pwm_step + 1 : 0;
+        next_ns = (u64)pwm_period_us * NSEC_PER_USEC;
+    }
+    else {
+        pwm_level = !pwm_level;
+        next_ns = pwm_level ? pwm_on_ns : pwm_off_ns;
+    }
+    // single line write, cheaper than the whole bank
+    __assign_bit(0, bank_state, pwm_level);
+    gpio_set_value(led_gpio, pwm_level);
+
+    if(pwm_edges == 0 || late < pwm_jitter_min)
+        pwm_jitter_min = late;
+    if(pwm_edges == 0 || late > pwm_jitter_max)
+        pwm_jitter_max = late;
+    pwm_jitter_sum += late;
+    pwm_edges++;
+    // stay on the original grid, count edges we were too late for
+    overruns = hrtimer_forward_now(timer, ns_to_ktime(next_ns));
+    if(overruns > 1)
+        pwm_missed += overruns - 1;
+    spin_unlock(&led_lock);
+    return HRTIMER_RESTART;
+}
+
+// caller holds pwm_mutex, LED goes back to led_state
+static void pwm_stop(void){
+    unsigned long flags;
+
+    spin_lock_irqsave(&led_lock, flags);
+    pwm_running = false;
+    spin_unlock_irqrestore(&led_lock, flags);
+    hrtimer_cancel(&pwm_timer);
+
+    bank_set(1, led_state);
+}
+
+// caller holds pwm_mutex, explicit line 0 state ends any waveform
+static void pwm_disable(void){
+    if(pwm_period_us != 0) {
+        pwm_period_us = 0;
+        pwm_stop();
+    }
+}
+
+// caller holds pwm_mutex, (re)starts the engine with the current attributes
+static int pwm_apply(void){
+    u64 period_ns = (u64)pwm_period_us * NSEC_PER_USEC;
+    unsigned long flags;
+
+    pwm_stop();
+    // 0% and 100% need no edges
+    if(period_ns == 0 || (pwm_pattern[0] == '\0' && (pwm_duty == 0 || pwm_duty >= 100)))
+        return 0;
+    // edges are driven from hardirq, a sleeping LED line can't do that
+    if(gpiod_cansleep(bank_desc[0]))
+        return -EOPNOTSUPP;
+
+    spin_lock_irqsave(&led_lock, flags);
+    pwm_on_ns = div_u64(period_ns * pwm_duty, 100);
+    pwm_off_ns = period_ns - pwm_on_ns;
+    pwm_level = 0;
+    pwm_step = 0;
+    pwm_edges = pwm_missed = 0;
+    pwm_jitter_min = pwm_jitter_max = pwm_jitter_sum = 0;
+    pwm_running = true;
+    spin_unlock_irqrestore(&led_lock, flags);
+    hrtimer_start(&pwm_timer, 0, HRTIMER_MODE_REL);
+    return 0;
+}
+
 static ssize_t led_state_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
-    int ret;
+    int ret, state;
 
-    ret = kstrtoint(buf, 10, &led_state);
+    ret = kstrtoint(buf, 10, &state);
     if(ret < 0)
         return ret;
 
-    if(led_state == 0)
-        gpio_set_value(LED_GPIO,0);
-    else if(led_state != 0)
-        gpio_set_value(LED_GPIO,1);
+    mutex_lock(&pwm_mutex);
+    pwm_disable();
+    led_set(state != 0);
+    mutex_unlock(&pwm_mutex);
+    return count;
+}
+
+static ssize_t bank_show(struct kobject *kobj, struct kobj_attribute *attr, char*buf){
+    return sprintf(buf,"%lx\n", READ_ONCE(bank_state[0]));
+}
+
+// "<value>" sets all lines, "<mask> <value>" only the lines in mask, both hex
+static ssize_t bank_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+    unsigned long mask, value;
 
+    switch(sscanf(buf, "%lx %lx", &mask, &value)) {
+    case 1:
+        value = mask;
+        mask = ~0UL;
+        break;
+    case 2:
+        break;
+    default:
+        return -EINVAL;
+    }
+    mutex_lock(&pwm_mutex);
+    if(mask & 1)
+        pwm_disable();
+    bank_set(mask, value);
+    mutex_unlock(&pwm_mutex);
     return count;
 }
 
+static ssize_t line_show(struct kobject *kobj, struct kobj_attribute *attr, char*buf){
+    int line = attr - line_attrs;
+    return sprintf(buf,"%d\n", test_bit(line, bank_state));
+}
+
+static ssize_t line_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+    int line = attr - line_attrs;
+    int ret, state;
+
+    ret = kstrtoint(buf, 10, &state);
+    if(ret < 0)
+        return ret;
+    mutex_lock(&pwm_mutex);
+    if(line == 0)
+        pwm_disable();
+    bank_set(1UL << line, (unsigned long)(state != 0) << line);
+    mutex_unlock(&pwm_mutex);
+    return count;
+}
+
+static ssize_t period_us_show(struct kobject *kobj, struct kobj_attribute *attr, char*buf){
+    return sprintf(buf,"%u\n", pwm_period_us);
+}
+
+static ssize_t period_us_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 10, &val);
+    if(ret < 0)
+        return ret;
+    // below ~10us the timer can't keep up anyway
+    if(val != 0 && val < 10)
+        return -EINVAL;
+    mutex_lock(&pwm_mutex);
+    pwm_period_us = val;
+    ret = pwm_apply();
+    if(ret < 0)
+        pwm_period_us = 0;
+    mutex_unlock(&pwm_mutex);
+    return ret < 0 ? ret : count;
+}
+
+static ssize_t duty_show(struct kobject *kobj, struct kobj_attribute *attr, char*buf){
+    return sprintf(buf,"%u\n", pwm_duty);
+}
+
+static ssize_t duty_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 10, &val);
+    if(ret < 0)
+        return ret;
+    if(val > 100)
+        return -EINVAL;
+    mutex_lock(&pwm_mutex);
+    pwm_duty = val;
+    ret = pwm_apply();
+    mutex_unlock(&pwm_mutex);
+    return ret < 0 ? ret : count;
+}
+
+static ssize_t pattern_show(struct kobject *kobj, struct kobj_attribute *attr, char*buf){
+    return sprintf(buf,"%s\n", pwm_pattern);
+}
+
+static ssize_t pattern_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+    size_t len = count;
+    size_t i;
+    int ret;
+
+    if(len > 0 && buf[len - 1] == '\n')
+        len--;
+    if(len > PWM_PATTERN_MAX)
+        return -EINVAL;
+    for(i = 0; i < len; i++)
+        if(buf[i] != '0' && buf[i] != '1')
+            return -EINVAL;
+    mutex_lock(&pwm_mutex);
+    memcpy(pwm_pattern, buf, len);
+    pwm_pattern[len] = '\0';
+    ret = pwm_apply();
+    mutex_unlock(&pwm_mutex);
+    return ret < 0 ? ret : count;
+}
+
+static ssize_t pwm_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char*buf){
+    u64 edges, missed;
+    s64 min, max, sum;
+    unsigned long flags;
+
+    spin_lock_irqsave(&led_lock, flags);
+    edges = pwm_edges;
+    missed = pwm_missed;
+    min = pwm_jitter_min;
+    max = pwm_jitter_max;
+    sum = pwm_jitter_sum;
+    spin_unlock_irqrestore(&led_lock, flags);
+    return sprintf(buf,"edges=%llu missed=%llu jitter_min_ns=%lld jitter_avg_ns=%lld jitter_max_ns=%lld\n",
+        edges, missed, min, edges ? div64_s64(sum, edges) : 0, max);
+}
+
+static ssize_t change_count_show(struct kobject *kobj, struct kobj_attribute *attr, char*buf){
+    return sprintf(buf,"%lu\n", READ_ONCE(led_changes));
+}
+
+static ssize_t last_change_ns_show(struct kobject *kobj, struct kobj_attribute *attr, char*buf){
+    unsigned long flags;
+    u64 ns;
+
+    spin_lock_irqsave(&led_lock, flags);
+    ns = led_change_ns;
+    spin_unlock_irqrestore(&led_lock, flags);
+    return sprintf(buf,"%llu\n", ns);
+}
+
 /* Sysfs attributes cannot be world-writable. */
 static struct kobj_attribute state_attribute =
     __ATTR(led_state,0664,led_state_show,led_state_store);
+static struct kobj_attribute bank_attribute = __ATTR(bank,0664,bank_show,bank_store);
+static struct kobj_attribute change_count_attribute = __ATTR_RO(change_count);
+static struct kobj_attribute last_change_ns_attribute = __ATTR_RO(last_change_ns);
+static struct kobj_attribute period_us_attribute = __ATTR(period_us,0664,period_us_show,period_us_store);
+static struct kobj_attribute duty_attribute = __ATTR(duty,0664,duty_show,duty_store);
+static struct kobj_attribute pattern_attribute = __ATTR(pattern,0664,pattern_show,pattern_store);
+static struct kobj_attribute pwm_stats_attribute = __ATTR_RO(pwm_stats);
 
 static struct attribute *attrs[] = {
     &state_attribute.attr,
+    &bank_attribute.attr,
+    &change_count_attribute.attr,
+    &last_change_ns_attribute.attr,
+    &period_us_attribute.attr,
+    &duty_attribute.attr,
+    &pattern_attribute.attr,
+    &pwm_stats_attribute.attr,
     NULL,/* need to NULL terminate the list of attributes */
 };
 
@@ -55,56 +386,154 @@ static struct attribute_group attr_group = {
     .attrs = attrs,
 };
 
-static struct kobject *led_kobj;
+static int match_chip_label(struct gpio_chip *chip, void *data){
+    return strcmp(chip->label, data) == 0;
+}
 
-static int __init led_init(void){
+// chip_label + offset to the global number the gpio_* calls use
+static int led_resolve_gpio(struct gpio_chip *chip, int *gpio){
+    if(chip_label == NULL)
+        return 0;
+    if(chip == NULL || *gpio < 0 || *gpio >= chip->ngpio) {
+        printk(KERN_ERR "%s: no line %d on gpio chip %s.\n", THIS_MODULE->name, *gpio, chip_label);
+        return -ENODEV;
+    }
+    *gpio += chip->base;
+    return 0;
+}
+
+static int led_request_gpio(int gpio, int state){
     int retval;
-    
-	bool valid = gpio_is_valid(LED_GPIO);
+    bool valid;
+
+    valid = gpio_is_valid(gpio);
     if(!valid) {
-        printk(KERN_ERR "%s: GPIO pin %d doesn't exist.\n", THIS_MODULE->name, LED_GPIO);
-        retval = -1;
-        goto gpio_invalid;
+        printk(KERN_ERR "%s: GPIO pin %d doesn't exist.\n", THIS_MODULE->name, gpio);
+        return -1;
     }
-    printk(KERN_INFO "%s: GPIO pin %d exists.\n", THIS_MODULE->name, LED_GPIO);
+    printk(KERN_INFO "%s: GPIO pin %d exists.\n", THIS_MODULE->name, gpio);
 
-    retval = gpio_request(LED_GPIO, "bbb-led");
+    retval = gpio_request(gpio, "bbb-led");
     if(retval != 0) {
-        printk(KERN_ERR "%s: GPIO pin %d is busy.\n", THIS_MODULE->name, LED_GPIO);
-        goto gpio_invalid;
+        printk(KERN_ERR "%s: GPIO pin %d is busy.\n", THIS_MODULE->name, gpio);
+        return retval;
     }
-    printk(KERN_INFO "%s: GPIO pin %d acquired.\n", THIS_MODULE->name, LED_GPIO);
+    printk(KERN_INFO "%s: GPIO pin %d acquired.\n", THIS_MODULE->name, gpio);
 
-    led_state = 1;
-    retval = gpio_direction_output(LED_GPIO, led_state);
+    retval = gpio_direction_output(gpio, state);
     if(retval != 0) {
-        printk(KERN_ERR "%s: GPIO pin %d direction not set.\n", THIS_MODULE->name, LED_GPIO);
-        goto gpio_direction_failed;
+        printk(KERN_ERR "%s: GPIO pin %d direction not set.\n", THIS_MODULE->name, gpio);
+        gpio_free(gpio);
+        return retval;
     }
-    printk(KERN_INFO "%s: GPIO pin %d direction set to OUTPUT.\n", THIS_MODULE->name, LED_GPIO);
+    printk(KERN_INFO "%s: GPIO pin %d direction set to OUTPUT.\n", THIS_MODULE->name, gpio);
+    return 0;
+}
 
+static void line_attrs_free(void){
+    int i;
 
-    led_kobj = kobject_create_and_add("kobject_led", kernel_kobj);
-    if(!led_kobj)
+    for(i = 0; line_attrs != NULL && i < n_led_gpios; i++)
+        kfree(line_attrs[i].attr.name);
+    kfree(line_attrs);
+    kfree(line_attr_list);
+}
+
+// lines/line0 .. lines/line<n-1>, same as one bit of bank each
+static int line_attrs_create(void){
+    int i;
+
+    line_attrs = kcalloc(n_led_gpios, sizeof(*line_attrs), GFP_KERNEL);
+    line_attr_list = kcalloc(n_led_gpios + 1, sizeof(*line_attr_list), GFP_KERNEL);
+    if(line_attrs == NULL || line_attr_list == NULL)
+        goto nomem;
+    for(i = 0; i < n_led_gpios; i++) {
+        line_attrs[i].attr.name = kasprintf(GFP_KERNEL, "line%d", i);
+        if(line_attrs[i].attr.name == NULL)
+            goto nomem;
+        line_attrs[i].attr.mode = 0664;
+        line_attrs[i].show = line_show;
+        line_attrs[i].store = line_store;
+        sysfs_attr_init(&line_attrs[i].attr);
+        line_attr_list[i] = &line_attrs[i].attr;
+    }
+    line_group.attrs = line_attr_list;
+    if(sysfs_create_group(led_kobj, &line_group) != 0) {
+        line_attrs_free();
         return -ENOMEM;
+    }
+    return 0;
+
+nomem:
+    line_attrs_free();
+    return -ENOMEM;
+}
+
+static int __init led_init(void){
+    struct gpio_chip *chip = NULL;
+    int retval, i;
+
+    if(n_led_gpios < 1)
+        return -EINVAL;
+    if(chip_label != NULL)
+        chip = gpiochip_find(chip_label, match_chip_label);
+
+    for(i = 0; i < n_led_gpios; i++) {
+        retval = led_resolve_gpio(chip, &led_gpios[i]);
+        if(retval != 0)
+            goto gpio_failed;
+        // LED starts on, the rest of the bank off
+        retval = led_request_gpio(led_gpios[i], i == 0);
+        if(retval != 0)
+            goto gpio_failed;
+        bank_desc[i] = gpio_to_desc(led_gpios[i]);
+        bank_cansleep |= gpiod_cansleep(bank_desc[i]);
+    }
+    led_gpio = led_gpios[0];
+    led_state = 1;
+    __set_bit(0, bank_state);
+
+    hrtimer_init(&pwm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    pwm_timer.function = pwm_timer_fn;
+
+
+    led_kobj = kobject_create_and_add("kobject_led", kernel_kobj);
+    if(!led_kobj) {
+        retval = -ENOMEM;
+        goto gpio_failed;
+    }
     
     /* Create the files associated with this kobject */
     retval = sysfs_create_group(led_kobj,&attr_group);
     if(retval != 0)
-        kobject_put(led_kobj);
+        goto sysfs_create_failed;
+
+    retval = line_attrs_create();
+    if(retval != 0)
+        goto sysfs_create_failed;
     
-    return retval;
+    return 0;
 
-gpio_direction_failed:
-    gpio_free(LED_GPIO);
-gpio_invalid:
+sysfs_create_failed:
+    kobject_put(led_kobj);
+gpio_failed:
+    while(--i >= 0)
+        gpio_free(led_gpios[i]);
     return retval;
 }
 
 static void __exit led_exit(void){
+    int i;
+
     kobject_put(led_kobj);
-    gpio_free(LED_GPIO);
-    printk(KERN_INFO "%s: GPIO pin %d released.\n", THIS_MODULE->name, LED_GPIO);
+    line_attrs_free();
+    // no more stores after the attributes are gone
+    pwm_running = false;
+    hrtimer_cancel(&pwm_timer);
+    for(i = 0; i < n_led_gpios; i++) {
+        gpio_free(led_gpios[i]);
+        printk(KERN_INFO "%s: GPIO pin %d released.\n", THIS_MODULE->name, led_gpios[i]);
+    }
 }
 
 module_init(led_init);
@@ -0,0 +1,373 @@
+#include "pchar.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+namespace pchar {
+
+namespace {
+
+[[noreturn]] void throw_errno(const std::string& what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+bool would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+}  // namespace
+
+// ---- Device ----
+
+Device::Device(const std::string& path, int flags) : path_(path)
+{
+    fd_ = ::open(path.c_str(), flags);
+    if (fd_ < 0)
+        throw_errno("open " + path);
+}
+
+Device Device::open_minor(int minor, int flags)
+{
+    return Device("/dev/my_char" + std::to_string(minor), flags);
+}
+
+Device::~Device()
+{
+    close();
+}
+
+Device::Device(Device&& other) noexcept : fd_(other.fd_), path_(std::move(other.path_))
+{
+    other.fd_ = -1;
+}
+
+Device& Device::operator=(Device&& other) noexcept
+{
+    if (this != &other) {
+        close();
+        fd_ = other.fd_;
+        path_ = std::move(other.path_);
+        other.fd_ = -1;
+    }
+    return *this;
+}
+
+void Device::close()
+{
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+void Device::set_nonblocking(bool on)
+{
+    int flags = ::fcntl(fd_, F_GETFL);
+    if (flags < 0)
+        throw_errno("F_GETFL " + path_);
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if (::fcntl(fd_, F_SETFL, flags) < 0)
+        throw_errno("F_SETFL " + path_);
+}
+
+void Device::clear()
+{
+    if (::ioctl(fd_, FIFO_CLEAR) != 0)
+        throw_errno("FIFO_CLEAR " + path_);
+}
+
+Info Device::info() const
+{
+    info_t raw;
+    if (::ioctl(fd_, FIFO_INFO, &raw) != 0)
+        throw_errno("FIFO_INFO " + path_);
+    return Info{raw.size, raw.avail, raw.len};
+}
+
+void Device::resize(unsigned long size)
+{
+    if (::ioctl(fd_, FIFO_RESIZE, size) != 0)
+        throw_errno("FIFO_RESIZE " + path_);
+}
+
+void Device::set_lane(int lane)
+{
+    if (::ioctl(fd_, FIFO_SET_LANE, (unsigned long)lane) != 0)
+        throw_errno("FIFO_SET_LANE " + path_);
+}
+
+lane_info_t Device::lane_info() const
+{
+    lane_info_t raw;
+    if (::ioctl(fd_, FIFO_LANE_INFO, &raw) != 0)
+        throw_errno("FIFO_LANE_INFO " + path_);
+    return raw;
+}
+
+stats_t Device::stats() const
+{
+    stats_t raw;
+    if (::ioctl(fd_, FIFO_STATS, &raw) != 0)
+        throw_errno("FIFO_STATS " + path_);
+    return raw;
+}
+
+void Device::coalesce(unsigned int size, unsigned int delay_us)
+{
+    coalesce_t raw{size, delay_us};
+    if (::ioctl(fd_, FIFO_COALESCE, &raw) != 0)
+        throw_errno("FIFO_COALESCE " + path_);
+}
+
+void Device::flush()
+{
+    if (::ioctl(fd_, FIFO_FLUSH) != 0)
+        throw_errno("FIFO_FLUSH " + path_);
+}
+
+ssize_t Device::read_some(void* buf, size_t len)
+{
+    while (true) {
+        ssize_t n = ::read(fd_, buf, len);
+        if (n >= 0)
+            return n;
+        if (would_block())
+            return -1;
+        if (errno != EINTR)
+            throw_errno("read " + path_);
+    }
+}
+
+ssize_t Device::write_some(const void* buf, size_t len)
+{
+    while (true) {
+        ssize_t n = ::write(fd_, buf, len);
+        if (n >= 0)
+            return n;
+        if (would_block())
+            return -1;
+        if (errno != EINTR)
+            throw_errno("write " + path_);
+    }
+}
+
+void Device::write_all(const void* buf, size_t len)
+{
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t n = write_some(p, len);
+        if (n < 0)
+            throw std::system_error(EAGAIN, std::generic_category(), "write_all on non-blocking " + path_);
+        p += n;
+        len -= n;
+    }
+}
+
+// ---- Buffer / BufferPool ----
+
+Buffer::~Buffer()
+{
+    release();
+}
+
+Buffer::Buffer(Buffer&& other) noexcept
+    : pool_(other.pool_), mem_(std::move(other.mem_)), cap_(other.cap_), len_(other.len_)
+{
+    other.pool_ = nullptr;
+    other.cap_ = other.len_ = 0;
+}
+
+Buffer& Buffer::operator=(Buffer&& other) noexcept
+{
+    if (this != &other) {
+        release();
+        pool_ = other.pool_;
+        mem_ = std::move(other.mem_);
+        cap_ = other.cap_;
+        len_ = other.len_;
+        other.pool_ = nullptr;
+        other.cap_ = other.len_ = 0;
+    }
+    return *this;
+}
+
+void Buffer::release()
+{
+    if (pool_ != nullptr && mem_)
+        pool_->put(std::move(mem_));
+    pool_ = nullptr;
+    mem_.reset();
+    cap_ = len_ = 0;
+}
+
+Buffer BufferPool::acquire()
+{
+    std::unique_ptr<char[]> mem;
+    if (!free_.empty()) {
+        mem = std::move(free_.back());
+        free_.pop_back();
+    } else {
+        mem.reset(new char[buf_size_]);
+    }
+    return Buffer(this, std::move(mem), buf_size_);
+}
+
+void BufferPool::put(std::unique_ptr<char[]> mem)
+{
+    if (free_.size() < max_free_)
+        free_.push_back(std::move(mem));
+}
+
+// ---- batch helpers ----
+
+ssize_t write_batch(Device& dev, const std::vector<std::string_view>& records)
+{
+    std::vector<iovec> iov;
+    size_t i = 0, total = 0;
+
+    iov.reserve(std::min<size_t>(records.size(), IOV_MAX));
+    while (i < records.size()) {
+        // one syscall per IOV_MAX records
+        iov.clear();
+        size_t want = 0;
+        for (; i < records.size() && iov.size() < IOV_MAX; i++) {
+            iov.push_back(iovec{const_cast<char*>(records[i].data()), records[i].size()});
+            want += records[i].size();
+        }
+        ssize_t n;
+        do {
+            n = ::writev(dev.fd(), iov.data(), iov.size());
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            if (would_block())
+                return total ? (ssize_t)total : -1;
+            throw_errno("writev " + dev.path());
+        }
+        total += n;
+        // device full part way through, the caller resumes from here
+        if ((size_t)n < want)
+            break;
+    }
+    return total;
+}
+
+std::vector<Buffer> read_batch(Device& dev, BufferPool& pool, size_t max_bufs)
+{
+    std::vector<Buffer> bufs;
+    std::vector<iovec> iov;
+
+    int flags = ::fcntl(dev.fd(), F_GETFL);
+    if (flags < 0)
+        throw_errno("F_GETFL " + dev.path());
+    if (!(flags & O_NONBLOCK))
+        throw std::invalid_argument("read_batch needs a non-blocking " + dev.path());
+
+    max_bufs = std::min<size_t>(max_bufs, IOV_MAX);
+    bufs.reserve(max_bufs);
+    iov.reserve(max_bufs);
+    for (size_t i = 0; i < max_bufs; i++) {
+        bufs.push_back(pool.acquire());
+        iov.push_back(iovec{bufs.back().data(), bufs.back().capacity()});
+    }
+
+    ssize_t n;
+    do {
+        n = ::readv(dev.fd(), iov.data(), iov.size());
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        if (would_block())
+            n = 0;
+        else
+            throw_errno("readv " + dev.path());
+    }
+
+    // hand back the filled ones, the rest return to the pool here
+    size_t left = n, used = 0;
+    for (; used < bufs.size() && left > 0; used++) {
+        size_t len = std::min(left, bufs[used].capacity());
+        bufs[used].resize(len);
+        left -= len;
+    }
+    bufs.resize(used);
+    return bufs;
+}
+
+// ---- Reactor ----
+
+Reactor::Reactor()
+{
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ < 0)
+        throw_errno("epoll_create1");
+}
+
+Reactor::~Reactor()
+{
+    if (epfd_ >= 0)
+        ::close(epfd_);
+}
+
+void Reactor::add(Device& dev, uint32_t events, Handler handler)
+{
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = dev.fd();
+    if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, dev.fd(), &ev) != 0)
+        throw_errno("EPOLL_CTL_ADD " + dev.path());
+    entries_[dev.fd()] = Entry{&dev, std::move(handler)};
+}
+
+void Reactor::modify(Device& dev, uint32_t events)
+{
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = dev.fd();
+    if (::epoll_ctl(epfd_, EPOLL_CTL_MOD, dev.fd(), &ev) != 0)
+        throw_errno("EPOLL_CTL_MOD " + dev.path());
+}
+
+void Reactor::remove(Device& dev)
+{
+    if (entries_.erase(dev.fd()) != 0)
+        ::epoll_ctl(epfd_, EPOLL_CTL_DEL, dev.fd(), nullptr);
+}
+
+int Reactor::run_once(int timeout_ms)
+{
+    epoll_event events[64];
+    int n, ran = 0;
+
+    do {
+        n = ::epoll_wait(epfd_, events, 64, timeout_ms);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        throw_errno("epoll_wait");
+    for (int i = 0; i < n; i++) {
+        // an earlier handler may have removed this device
+        auto it = entries_.find(events[i].data.fd);
+        if (it == entries_.end())
+            continue;
+        Handler handler = it->second.handler;
+        handler(*it->second.dev, events[i].events);
+        ran++;
+    }
+    return ran;
+}
+
+void Reactor::run()
+{
+    stop_ = false;
+    while (!stop_ && !entries_.empty())
+        run_once(-1);
+}
+
+}  // namespace pchar
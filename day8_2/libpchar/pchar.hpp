@@ -0,0 +1,166 @@
+#ifndef PCHAR_HPP
+#define PCHAR_HPP
+
+// C++ client for /dev/my_char* (pchar_multidev_ioctl). Errors other than
+// EAGAIN/EINTR are thrown as std::system_error.
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/types.h>
+
+extern "C" {
+#include "../pchar_ioctl.h"
+}
+
+namespace pchar {
+
+struct Info {
+    int size;  // total fifo bytes over all lanes
+    int avail;
+    int len;
+};
+
+// Owning handle of one open device, move only.
+class Device {
+public:
+    Device() = default;
+    explicit Device(const std::string& path, int flags = O_RDWR | O_CLOEXEC);
+    static Device open_minor(int minor, int flags = O_RDWR | O_CLOEXEC);
+    ~Device();
+
+    Device(Device&& other) noexcept;
+    Device& operator=(Device&& other) noexcept;
+    Device(const Device&) = delete;
+    Device& operator=(const Device&) = delete;
+
+    int fd() const { return fd_; }
+    const std::string& path() const { return path_; }
+    explicit operator bool() const { return fd_ >= 0; }
+    void close();
+    void set_nonblocking(bool on);
+
+    // ioctls of pchar_ioctl.h
+    void clear();
+    Info info() const;
+    void resize(unsigned long size);  // every lane
+    void set_lane(int lane);
+    lane_info_t lane_info() const;
+    stats_t stats() const;
+    void coalesce(unsigned int size, unsigned int delay_us = 0);
+    void flush();
+
+    // -1 when a non-blocking device has no data/room, else bytes moved
+    ssize_t read_some(void* buf, size_t len);
+    ssize_t write_some(const void* buf, size_t len);
+    // blocking loop until everything is written
+    void write_all(const void* buf, size_t len);
+
+private:
+    int fd_ = -1;
+    std::string path_;
+};
+
+class BufferPool;
+
+// Pool buffer on loan, goes back to its pool when destroyed.
+class Buffer {
+public:
+    Buffer() = default;
+    ~Buffer();
+    Buffer(Buffer&& other) noexcept;
+    Buffer& operator=(Buffer&& other) noexcept;
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+
+    char* data() { return mem_.get(); }
+    const char* data() const { return mem_.get(); }
+    size_t capacity() const { return cap_; }
+    size_t size() const { return len_; }  // bytes filled by read_batch
+    void resize(size_t len) { len_ = len; }
+    std::string_view view() const { return std::string_view(mem_.get(), len_); }
+
+private:
+    friend class BufferPool;
+    Buffer(BufferPool* pool, std::unique_ptr<char[]> mem, size_t cap)
+        : pool_(pool), mem_(std::move(mem)), cap_(cap) {}
+    void release();
+
+    BufferPool* pool_ = nullptr;
+    std::unique_ptr<char[]> mem_;
+    size_t cap_ = 0;
+    size_t len_ = 0;
+};
+
+// Fixed size buffers reused across reads. Single threaded, must outlive
+// the buffers it hands out.
+class BufferPool {
+public:
+    explicit BufferPool(size_t buf_size, size_t max_free = 64)
+        : buf_size_(buf_size), max_free_(max_free) {}
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    Buffer acquire();
+    size_t buf_size() const { return buf_size_; }
+    size_t free_count() const { return free_.size(); }
+
+private:
+    friend class Buffer;
+    void put(std::unique_ptr<char[]> mem);
+
+    size_t buf_size_;
+    size_t max_free_;
+    std::vector<std::unique_ptr<char[]>> free_;
+};
+
+// One writev() for many records; each record is a separate driver write.
+// Returns bytes written, -1 if a non-blocking device was full.
+ssize_t write_batch(Device& dev, const std::vector<std::string_view>& records);
+
+// One readv() into up to max_bufs pool buffers. Buffers that got no data
+// are not returned; an empty vector means nothing was available. The
+// driver reads once per iovec, so on a blocking fd a later buffer would
+// sleep on an empty fifo; dev must be non-blocking (std::invalid_argument).
+std::vector<Buffer> read_batch(Device& dev, BufferPool& pool, size_t max_bufs);
+
+// epoll loop multiplexing many devices on one thread.
+class Reactor {
+public:
+    using Handler = std::function<void(Device& dev, uint32_t events)>;
+
+    Reactor();
+    ~Reactor();
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    // dev must stay alive and keep its fd until remove()
+    void add(Device& dev, uint32_t events, Handler handler);
+    void modify(Device& dev, uint32_t events);
+    void remove(Device& dev);
+
+    // waits up to timeout_ms (-1 = forever), returns handlers run
+    int run_once(int timeout_ms);
+    // until stop() or no devices are left
+    void run();
+    void stop() { stop_ = true; }
+
+private:
+    struct Entry {
+        Device* dev;
+        Handler handler;
+    };
+    int epfd_ = -1;
+    bool stop_ = false;
+    std::unordered_map<int, Entry> entries_;
+};
+
+}  // namespace pchar
+
+#endif
@@ -0,0 +1,110 @@
+// Throughput of the raw one byte loop most consumers write by hand against
+// libpchar batching plus one reactor thread draining every device.
+//   ./pchar_tput [devices] [MB per device] [record bytes]
+// Needs pchar_multidev_ioctl loaded with at least that many devices.
+
+#include "pchar.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/epoll.h>
+
+using clk = std::chrono::steady_clock;
+
+static double mb_per_s(size_t bytes, clk::duration d)
+{
+    double s = std::chrono::duration<double>(d).count();
+    return bytes / s / 1e6;
+}
+
+// what pchar_test style consumers do: one byte write, one byte read
+static void naive(size_t bytes)
+{
+    pchar::Device dev = pchar::Device::open_minor(0);
+    char c = 'x';
+
+    dev.clear();
+    auto start = clk::now();
+    for (size_t i = 0; i < bytes; i++) {
+        dev.write_all(&c, 1);
+        dev.read_some(&c, 1);
+    }
+    std::printf("naive 1 byte loop, 1 device      : %8.2f MB/s\n", mb_per_s(bytes, clk::now() - start));
+}
+
+static void batched(int ndev, size_t bytes, size_t record)
+{
+    const size_t fifo = 64 * 1024;
+    const size_t batch = 64;
+    std::vector<pchar::Device> rd;
+    size_t total = 0;
+
+    // whole batches only, so the reader knows exactly when all data is in
+    bytes = (bytes + batch * record - 1) / (batch * record) * (batch * record);
+
+    for (int i = 0; i < ndev; i++) {
+        rd.push_back(pchar::Device::open_minor(i));
+        rd.back().clear();
+        rd.back().resize(fifo);
+        rd.back().set_nonblocking(true);
+    }
+
+    // producer: blocking writers, one writev of batch records per call
+    std::thread producer([&] {
+        std::vector<pchar::Device> wr;
+        std::string payload(record, 'x');
+        std::vector<std::string_view> records(batch, payload);
+        std::vector<size_t> sent(ndev, 0);
+        for (int i = 0; i < ndev; i++)
+            wr.push_back(pchar::Device::open_minor(i));
+        for (bool more = true; more; ) {
+            more = false;
+            for (int i = 0; i < ndev; i++) {
+                if (sent[i] >= bytes)
+                    continue;
+                sent[i] += pchar::write_batch(wr[i], records);
+                more = true;
+            }
+        }
+    });
+
+    pchar::BufferPool pool(4096);
+    pchar::Reactor reactor;
+    size_t want = bytes * ndev;
+    auto start = clk::now();
+    for (auto& dev : rd) {
+        reactor.add(dev, EPOLLIN, [&](pchar::Device& d, uint32_t) {
+            for (auto& buf : pchar::read_batch(d, pool, 16))
+                total += buf.size();
+            if (total >= want)
+                reactor.stop();
+        });
+    }
+    reactor.run();
+    auto elapsed = clk::now() - start;
+    producer.join();
+
+    std::printf("libpchar batch + reactor, %2d dev : %8.2f MB/s (record %zu B, %zu pooled buffers)\n",
+        ndev, mb_per_s(total, elapsed), record, pool.free_count());
+}
+
+int main(int argc, char* argv[])
+{
+    int ndev = argc > 1 ? std::atoi(argv[1]) : 3;
+    size_t mb = argc > 2 ? std::atol(argv[2]) : 16;
+    size_t record = argc > 3 ? std::atol(argv[3]) : 256;
+
+    try {
+        // the byte loop is slow, keep it short
+        naive(256 * 1024);
+        batched(ndev, mb * 1024 * 1024, record);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "pchar_tput: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -4,14 +4,178 @@
 
 #include "linux/ioctl.h"
 
+#define PCHAR_MAX_LANES 8
+
+// lane read scheduling
+#define PCHAR_SCHED_STRICT  0   // drain lane 0 first, then lane 1, ...
+#define PCHAR_SCHED_WRR     1   // weighted round robin across lanes
+
 typedef struct {
     short size; // total size of fifo
     short avail; // free size
     short len; // filled size
 }info_t;
 
+typedef struct {
+    int nr_lanes; // number of lanes in device
+    int sched; // PCHAR_SCHED_STRICT or PCHAR_SCHED_WRR
+    int size[PCHAR_MAX_LANES]; // per lane fifo size
+    int len[PCHAR_MAX_LANES]; // per lane filled size
+    int weight[PCHAR_MAX_LANES]; // per lane wrr weight
+}lane_info_t;
+
+typedef struct {
+    int sched; // PCHAR_SCHED_STRICT or PCHAR_SCHED_WRR
+    int weight[PCHAR_MAX_LANES]; // wrr weight of each lane, must be > 0
+}lane_sched_t;
+
+// record header of /dev/my_char_all reads, followed by len data bytes
+typedef struct {
+    unsigned short minor; // source my_charN
+    unsigned short len; // data bytes in record
+}rec_hdr_t;
+
+#define PCHAR_ALL_MAX_REC 0xffff
+#define PCHAR_ALL_MAX_WEIGHT 1024
+
+typedef struct {
+    int minor; // my_charN
+    int weight; // share of my_char_all reads, 1..PCHAR_ALL_MAX_WEIGHT
+}all_weight_t;
+
+typedef struct {
+    unsigned long long writes; // writes that stored data
+    unsigned long long reads; // reads that returned data
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long batches; // coalesced batches published
+    unsigned long long stage_dropped; // staged bytes a full device couldn't take on close
+}stats_t;
+
+typedef struct {
+    unsigned int size; // staging buffer bytes, 0 = coalescing off
+    unsigned int delay_us; // publish staged data after this long, 0 = default; rounded up to jiffies
+}coalesce_t;
+
+// verdicts returned by a FIFO_SET_BPF program
+#define PCHAR_BPF_DROP      0   // discard the write
+#define PCHAR_BPF_ACCEPT    1   // store the write
+#define PCHAR_BPF_SAMPLE    2   // store one in sample_every of these writes
+
+typedef struct {
+    int fd; // BPF_PROG_TYPE_SOCKET_FILTER program, -1 = detach
+    unsigned int sample_every; // for PCHAR_BPF_SAMPLE, 0 = 1
+}bpf_attach_t;
+
+typedef struct {
+    unsigned long long accepted;
+    unsigned long long dropped;
+    unsigned long long sampled; // PCHAR_BPF_SAMPLE writes stored
+    unsigned long long sample_skipped; // PCHAR_BPF_SAMPLE writes discarded
+    unsigned long long dropped_bytes;
+}bpf_stats_t;
+
+typedef struct {
+    int lane; // lane to export
+    int fd; // out: dma-buf fd
+    unsigned int size; // out: bytes in the dma-buf, same as lane fifo size
+}dmabuf_export_t;
+
+// readable bytes of the exported lane, at offset in the dma-buf
+typedef struct {
+    unsigned int offset;
+    unsigned int len; // contiguous bytes, the rest comes after FIFO_DMABUF_END
+}dmabuf_window_t;
+
+// elastic lane sizing, sizes are rounded up to a power of two
+typedef struct {
+    unsigned int min_size; // lanes never shrink below this
+    unsigned int max_size; // nor grow above it, 0 = elastic sizing off
+    unsigned int high_pct; // grow a lane a write leaves fuller than this
+    unsigned int low_pct; // shrink a lane that stays under this, 2 * low_pct < high_pct
+    unsigned int shrink_ms; // for this long, 0 = 1000
+}elastic_t;
+
+typedef struct {
+    unsigned long long grows;
+    unsigned long long shrinks;
+    unsigned long long stalls; // writes that found their lane full
+    unsigned long long failed; // resizes refused by memory limits
+}elastic_stats_t;
+
+typedef struct {
+    unsigned long long in; // bytes that went through the compressor
+    unsigned long long stored; // fifo bytes they took, record headers included
+    unsigned long long chunks;
+    unsigned long long raw_chunks; // chunks stored as is, they did not shrink
+    unsigned long long compress_ns;
+    unsigned long long decompress_ns;
+}lz_stats_t;
+
+// FIFO_INFO in full width, with logical bytes of a compressed device
+typedef struct {
+    unsigned int size; // physical fifo bytes of all lanes
+    unsigned int avail;
+    unsigned int len; // physical bytes held
+    unsigned int lz_chunk; // FIFO_SET_LZ chunk size, 0 = not compressed
+    unsigned long long logical_len; // bytes readers will get, same as len when not compressed
+    lz_stats_t lz;
+}info_ex_t;
+
+// what a writer over its rate limit gets
+#define PCHAR_RATE_SLEEP    0   // sleeps until tokens come in
+#define PCHAR_RATE_EAGAIN   1   // -EAGAIN, also what O_NONBLOCK writers always get
+
+// token buckets of FIFO_SET_RATE, rates of 0 = unlimited
+typedef struct {
+    unsigned long long bytes_per_sec;
+    unsigned long long bytes_burst; // bucket depth, 0 = one second worth
+    unsigned int ops_per_sec; // writes per second
+    unsigned int ops_burst;
+    int policy; // PCHAR_RATE_SLEEP or PCHAR_RATE_EAGAIN
+    int per_file; // 1 = limit this open file, 0 = the whole device
+}rate_limit_t;
+
+typedef struct {
+    unsigned long long throttled; // writes that found no tokens
+    unsigned long long throttle_ns; // time writers slept for tokens
+    unsigned long long refused; // writes that got -EAGAIN
+}rate_count_t;
+
+typedef struct {
+    rate_count_t dev; // device limit, all writers
+    rate_count_t file; // limit of the calling file
+}rate_stats_t;
+
+// eventfds signalled when the device fill level crosses a threshold
+typedef struct {
+    int rise_fd; // eventfd for going up to rise_pct, -1 = none
+    int fall_fd; // eventfd for going back under fall_pct, -1 = none
+    unsigned int rise_pct; // percent of all lane bytes, <= 100
+    unsigned int fall_pct; // < rise_pct
+}fill_notify_t;
+
 #define FIFO_CLEAR  _IO('x', 1)
 #define FIFO_INFO   _IOR('x', 2, info_t)
 #define FIFO_RESIZE _IOW('x', 3, long)
+#define FIFO_SET_LANE   _IOW('x', 4, long)  // lane 0 = highest priority
+#define FIFO_LANE_INFO  _IOR('x', 5, lane_info_t)
+#define FIFO_SET_SCHED  _IOW('x', 6, lane_sched_t)
+#define FIFO_ALL_WEIGHT _IOW('x', 7, all_weight_t) // on my_char_all only
+#define FIFO_STATS      _IOR('x', 8, stats_t)
+#define FIFO_COALESCE   _IOW('x', 9, coalesce_t) // per open file
+#define FIFO_FLUSH      _IO('x', 10) // publish staged data, same as fsync()
+#define FIFO_SET_BPF    _IOW('x', 11, bpf_attach_t) // per device write filter
+#define FIFO_BPF_STATS  _IOR('x', 12, bpf_stats_t)
+#define FIFO_EXPORT_DMABUF _IOWR('x', 13, dmabuf_export_t)
+#define FIFO_DMABUF_BEGIN  _IOR('x', 14, dmabuf_window_t) // waits for data unless O_NONBLOCK
+#define FIFO_DMABUF_END    _IOW('x', 15, long) // bytes of the window consumed
+#define FIFO_SET_ELASTIC   _IOW('x', 16, elastic_t)
+#define FIFO_ELASTIC_STATS _IOR('x', 17, elastic_stats_t)
+#define FIFO_SET_LZ        _IOW('x', 18, long) // lz4 chunk size, 0 = off; single lane devices only
+#define FIFO_INFO_EX       _IOR('x', 19, info_ex_t)
+#define FIFO_SET_RATE      _IOW('x', 20, rate_limit_t)
+#define FIFO_RATE_STATS    _IOR('x', 21, rate_stats_t)
+#define FIFO_FILL_NOTIFY   _IOW('x', 22, fill_notify_t) // both fds -1 = off
 
 #endif
@@ -0,0 +1,37 @@
+
+#ifndef __PCHAR_KAPI_H
+#define __PCHAR_KAPI_H
+
+#include <linux/types.h>
+
+/*
+ * In-kernel producer/consumer api of pchar_multidev_ioctl.
+ * Kernel clients share locking and wait queues with the /dev/my_charN path,
+ * so data written here wakes up blocked readers and vice versa.
+ * All calls may sleep, except pchar_ready_fn which runs under rcu_read_lock().
+ */
+
+struct pchar_device;
+
+// called after new data entered the device; must not sleep
+typedef void (*pchar_ready_fn)(struct pchar_device *pdev, void *ctx);
+
+#define PCHAR_LANE_BULK (-1) // lowest priority lane
+
+// device of given minor, NULL if no such device; valid till pchar module unload
+struct pchar_device *pchar_get_device(int minor);
+int pchar_device_minor(struct pchar_device *pdev);
+
+// return bytes copied, -EAGAIN if nonblock and nothing could be copied
+ssize_t pchar_kernel_write(struct pchar_device *pdev, int lane, const void *buf, size_t size, bool nonblock);
+ssize_t pchar_kernel_read(struct pchar_device *pdev, void *buf, size_t size, bool nonblock);
+
+// sleep till lane has room for a nonblock write; called from a kthread it
+// also returns once kthread_stop() was called. 0, -ERESTARTSYS on a signal
+int pchar_kernel_wait_write(struct pchar_device *pdev, int lane);
+
+// one data ready callback per device, -EBUSY if already taken
+int pchar_register_ready(struct pchar_device *pdev, pchar_ready_fn fn, void *ctx);
+void pchar_unregister_ready(struct pchar_device *pdev);
+
+#endif
@@ -0,0 +1,82 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/workqueue.h>
+#include <linux/slab.h>
+#include "pchar_kapi.h"
+
+/*
+ * Sample in-kernel client of pchar_multidev_ioctl.
+ * Writes a greeting into my_char<my_minor> and drains whatever arrives on it
+ * (from user space or other kernel producers) without any user copies.
+ */
+
+#define KCLIENT_BUF 64
+
+static int my_minor = 0;
+module_param(my_minor,int,0444);
+MODULE_PARM_DESC(my_minor, "minor of my_char device to attach to");
+
+static struct pchar_device *pdev;
+static struct work_struct drain_work;
+static atomic64_t drained_bytes;
+
+static void kclient_drain(struct work_struct *work)
+{
+    char kbuf[KCLIENT_BUF];
+    ssize_t nbytes;
+
+    // ready callback may coalesce, so drain till empty
+    while ((nbytes = pchar_kernel_read(pdev, kbuf, sizeof(kbuf), true)) > 0)
+    {
+        atomic64_add(nbytes, &drained_bytes);
+        printk(KERN_INFO "%s : drained %zd bytes from my_char%d\n", THIS_MODULE->name, nbytes, my_minor);
+    }
+}
+
+// runs in writer context under rcu_read_lock, so only kick the work
+static void kclient_ready(struct pchar_device *dev, void *ctx)
+{
+    schedule_work(&drain_work);
+}
+
+static __init int kclient_init(void)
+{
+    static const char greeting[] = "hello from pchar_kclient\n";
+    ssize_t ret;
+
+    printk(KERN_INFO "%s : kclient_init called\n", THIS_MODULE->name);
+    pdev = pchar_get_device(my_minor);
+    if (pdev == NULL)
+    {
+        printk(KERN_ERR "%s : my_char%d doesn't exist\n", THIS_MODULE->name, my_minor);
+        return -ENODEV;
+    }
+
+    INIT_WORK(&drain_work, kclient_drain);
+    ret = pchar_register_ready(pdev, kclient_ready, NULL);
+    if (ret != 0)
+    {
+        printk(KERN_ERR "%s : pchar_register_ready() failed\n", THIS_MODULE->name);
+        return ret;
+    }
+    printk(KERN_INFO "%s : attached to my_char%d\n", THIS_MODULE->name, pchar_device_minor(pdev));
+
+    // attached first, so the greeting comes back through kclient_drain
+    ret = pchar_kernel_write(pdev, PCHAR_LANE_BULK, greeting, sizeof(greeting) - 1, true);
+    printk(KERN_INFO "%s : greeting write returned %zd\n", THIS_MODULE->name, ret);
+    return 0;
+}
+
+static __exit void kclient_exit(void)
+{
+    pchar_unregister_ready(pdev);
+    cancel_work_sync(&drain_work);
+    printk(KERN_INFO "%s : detached, drained %lld bytes in total\n", THIS_MODULE->name, (long long)atomic64_read(&drained_bytes));
+}
+
+module_init(kclient_init);
+module_exit(kclient_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Parth");
+MODULE_DESCRIPTION("Sample in-kernel client of pchar devices");
@@ -0,0 +1,234 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "pchar_kapi.h"
+
+/*
+ * Load generator for pchar_multidev_ioctl.
+ * One kthread per entry of my_minors[] pushes synthetic data into that
+ * device through the in-kernel api, so readers can be benchmarked without
+ * any user space producer cost. Stats are in /sys/kernel/debug/pchar_loadgen.
+ */
+
+#define LOADGEN_MAX_THREADS 16
+
+static int my_minors[LOADGEN_MAX_THREADS] = { 0 };
+static int my_nminors = 1;
+module_param_array(my_minors,int,&my_nminors,0444);
+MODULE_PARM_DESC(my_minors, "my_char minors to load, one kthread each");
+static int my_cpus[LOADGEN_MAX_THREADS] = { [0 ... LOADGEN_MAX_THREADS - 1] = -1 };
+static int my_ncpus;
+module_param_array(my_cpus,int,&my_ncpus,0444);
+MODULE_PARM_DESC(my_cpus, "cpu to bind each kthread to, -1 = unbound");
+static unsigned int my_rate = 0;
+module_param(my_rate,uint,0444);
+MODULE_PARM_DESC(my_rate, "target bytes/s per kthread, 0 = as fast as possible");
+static unsigned int my_chunk = 64;
+module_param(my_chunk,uint,0444);
+MODULE_PARM_DESC(my_chunk, "bytes per write");
+static int my_lane = PCHAR_LANE_BULK;
+module_param(my_lane,int,0444);
+MODULE_PARM_DESC(my_lane, "lane to write into, -1 = bulk lane");
+static bool my_stamp = true;
+module_param(my_stamp,bool,0444);
+MODULE_PARM_DESC(my_stamp, "start each chunk with ktime_get_ns() of the write, for wakeup latency");
+
+struct loadgen_thread
+{
+    struct task_struct *task;
+    struct pchar_device *pdev;
+    char *buf;
+    int minor;
+    int cpu;
+    int error;
+    u64 start_ns;
+    u64 stop_ns;
+    u64 bytes;
+    u64 writes; // complete chunks
+    u64 backpressure_ns; // time spent waiting for free space
+};
+
+static struct loadgen_thread threads[LOADGEN_MAX_THREADS];
+static struct dentry *loadgen_dir;
+
+static int loadgen_fn(void *param)
+{
+    struct loadgen_thread *lt = param;
+    u64 now, due, bp_start = 0;
+    unsigned long us;
+    unsigned int off = 0;
+    ssize_t ret;
+
+    lt->start_ns = ktime_get_ns();
+    while (!kthread_should_stop())
+    {
+        if (my_rate != 0)
+        {
+            // pace: don't run ahead of rate * elapsed time
+            due = lt->start_ns + mul_u64_u32_div(lt->bytes, NSEC_PER_SEC, my_rate);
+            now = ktime_get_ns();
+            if (due > now)
+            {
+                us = div_u64(due - now, NSEC_PER_USEC);
+                if (us != 0)
+                    usleep_range(us, us + 50);
+                else
+                    cond_resched();
+                continue;
+            }
+        }
+
+        if (my_stamp && off == 0)
+        {
+            now = ktime_get_ns();
+            memcpy(lt->buf, &now, sizeof(now));
+        }
+        // finish partially written chunks so readers stay chunk aligned
+        ret = pchar_kernel_write(lt->pdev, my_lane, lt->buf + off, my_chunk - off, true);
+        if (ret == -EAGAIN)
+        {
+            // device full, time till reader makes room is backpressure
+            if (bp_start == 0)
+                bp_start = ktime_get_ns();
+            pchar_kernel_wait_write(lt->pdev, my_lane);
+            continue;
+        }
+        if (bp_start != 0)
+        {
+            lt->backpressure_ns += ktime_get_ns() - bp_start;
+            bp_start = 0;
+        }
+        if (ret < 0)
+        {
+            lt->error = ret;
+            printk(KERN_ERR "%s : write to my_char%d failed %zd\n", THIS_MODULE->name, lt->minor, ret);
+            break;
+        }
+        lt->bytes += ret;
+        off += ret;
+        if (off == my_chunk)
+        {
+            lt->writes++;
+            off = 0;
+        }
+        cond_resched();
+    }
+    lt->stop_ns = ktime_get_ns();
+
+    // task must stay alive till kthread_stop()
+    while (!kthread_should_stop())
+        msleep_interruptible(100);
+    return 0;
+}
+
+static int loadgen_stats_show(struct seq_file *m, void *v)
+{
+    struct loadgen_thread *lt = m->private;
+    u64 end = lt->stop_ns ? lt->stop_ns : ktime_get_ns();
+    u64 elapsed = end - lt->start_ns;
+
+    seq_printf(m, "minor: %d\n", lt->minor);
+    seq_printf(m, "cpu: %d\n", lt->cpu);
+    seq_printf(m, "bytes: %llu\n", lt->bytes);
+    seq_printf(m, "writes: %llu\n", lt->writes);
+    seq_printf(m, "elapsed_ns: %llu\n", elapsed);
+    seq_printf(m, "rate_bps: %llu\n", elapsed ? mul_u64_u64_div_u64(lt->bytes, NSEC_PER_SEC, elapsed) : 0);
+    seq_printf(m, "backpressure_ns: %llu\n", lt->backpressure_ns);
+    seq_printf(m, "error: %d\n", lt->error);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(loadgen_stats);
+
+static void loadgen_stop(int count)
+{
+    int i;
+    for (i = count - 1; i >= 0; i--)
+    {
+        kthread_stop(threads[i].task);
+        kfree(threads[i].buf);
+    }
+}
+
+static __init int loadgen_init(void)
+{
+    struct loadgen_thread *lt;
+    char name[16];
+    int i, ret;
+
+    printk(KERN_INFO "%s : loadgen_init called\n", THIS_MODULE->name);
+    if (my_chunk == 0 || (my_stamp && my_chunk < sizeof(u64)))
+    {
+        printk(KERN_ERR "%s : my_chunk=%u too small\n", THIS_MODULE->name, my_chunk);
+        return -EINVAL;
+    }
+
+    loadgen_dir = debugfs_create_dir("pchar_loadgen", NULL);
+    for (i = 0; i < my_nminors; i++)
+    {
+        lt = &threads[i];
+        lt->minor = my_minors[i];
+        lt->cpu = my_cpus[i];
+        lt->pdev = pchar_get_device(lt->minor);
+        if (lt->pdev == NULL)
+        {
+            printk(KERN_ERR "%s : my_char%d doesn't exist\n", THIS_MODULE->name, lt->minor);
+            ret = -ENODEV;
+            goto thread_failed;
+        }
+        if (lt->cpu >= 0 && (lt->cpu >= nr_cpu_ids || !cpu_online(lt->cpu)))
+        {
+            printk(KERN_ERR "%s : cpu %d is not online\n", THIS_MODULE->name, lt->cpu);
+            ret = -EINVAL;
+            goto thread_failed;
+        }
+        lt->buf = kmalloc(my_chunk, GFP_KERNEL);
+        if (lt->buf == NULL)
+        {
+            ret = -ENOMEM;
+            goto thread_failed;
+        }
+        memset(lt->buf, 'A' + i % 26, my_chunk);
+
+        lt->task = kthread_create(loadgen_fn, lt, "pchar_loadgen/%d", i);
+        if (IS_ERR(lt->task))
+        {
+            printk(KERN_ERR "%s : kthread_create() failed\n", THIS_MODULE->name);
+            ret = PTR_ERR(lt->task);
+            kfree(lt->buf);
+            goto thread_failed;
+        }
+        if (lt->cpu >= 0)
+            kthread_bind(lt->task, lt->cpu);
+        wake_up_process(lt->task);
+
+        sprintf(name, "stats%d", i);
+        debugfs_create_file(name, 0444, loadgen_dir, lt, &loadgen_stats_fops);
+        printk(KERN_INFO "%s : kthread %d loading my_char%d\n", THIS_MODULE->name, i, lt->minor);
+    }
+    return 0;
+
+thread_failed:
+    debugfs_remove_recursive(loadgen_dir);
+    loadgen_stop(i);
+    return ret;
+}
+
+static __exit void loadgen_exit(void)
+{
+    debugfs_remove_recursive(loadgen_dir);
+    loadgen_stop(my_nminors);
+    printk(KERN_INFO "%s : all kthreads stopped\n", THIS_MODULE->name);
+}
+
+module_init(loadgen_init);
+module_exit(loadgen_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Parth");
+MODULE_DESCRIPTION("Kthread load generator for pchar devices");
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "pchar_ioctl.h"
+
+/*
+ * CPU cost vs memory saved of FIFO_SET_LZ across chunk sizes.
+ *   ./pchar_lzbench [device] [fifo bytes]
+ * For each chunk size the device fifo is filled with text telemetry until
+ * writes would block, then drained and checked. Chunk 0 is the plain
+ * device. Physical is the fifo only; a compressed device also holds two
+ * chunk buffers and the lz4 state. Needs a single lane device
+ * (my_lanes=1) nobody else is using.
+ */
+
+#define TEXT_SIZE (32 << 20)
+#define IO_SIZE 4096
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// key=value lines like the collectors send
+static char *make_text(size_t size)
+{
+    static const char *status[] = { "OK", "OK", "OK", "WARN", "CRIT" };
+    unsigned int seed = 1;
+    unsigned long long ts = 1700000000000ULL;
+    char *text = malloc(size + 256);
+    size_t off = 0;
+
+    while (off < size)
+    {
+        seed = seed * 1103515245 + 12345;
+        ts += seed % 50;
+        off += sprintf(text + off, "ts=%llu host=node%02u cpu=%u.%u mem=%u temp=%u status=%s\n",
+            ts, (seed >> 8) % 32, (seed >> 4) % 100, seed % 10, (seed >> 12) % 100, 40 + (seed >> 16) % 30, status[(seed >> 20) % 5]);
+    }
+    return text;
+}
+
+static int run(int fd, const char *text, long chunk, long fifo)
+{
+    unsigned long long start, wr_ns, rd_ns;
+    char buf[IO_SIZE];
+    size_t in = 0, out = 0;
+    info_ex_t ix;
+    ssize_t n;
+
+    // mode changes need an empty device of the right size
+    ioctl(fd, FIFO_CLEAR);
+    if (ioctl(fd, FIFO_SET_LZ, 0L) != 0 || ioctl(fd, FIFO_RESIZE, fifo) != 0 || ioctl(fd, FIFO_SET_LZ, chunk) != 0)
+    {
+        perror("ioctl() failed");
+        return -1;
+    }
+
+    start = now_ns();
+    while (in < TEXT_SIZE && (n = write(fd, text + in, TEXT_SIZE - in < IO_SIZE ? TEXT_SIZE - in : IO_SIZE)) > 0)
+        in += n;
+    wr_ns = now_ns() - start;
+    if (ioctl(fd, FIFO_INFO_EX, &ix) != 0)
+    {
+        perror("ioctl() failed");
+        return -1;
+    }
+
+    start = now_ns();
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        if (memcmp(buf, text + out, n) != 0)
+        {
+            printf("chunk %ld: data differs after %zu bytes\n", chunk, out);
+            return -1;
+        }
+        out += n;
+    }
+    rd_ns = now_ns() - start;
+    if (out != in)
+    {
+        printf("chunk %ld: wrote %zu bytes, read %zu\n", chunk, in, out);
+        return -1;
+    }
+
+    printf("%6ld %9u %9llu %6.2fx %6.2f %5llu %9.1f %9.1f %9.1f %9.1f\n",
+        chunk, ix.size, ix.logical_len, (double)ix.logical_len / ix.size,
+        ix.lz.stored ? (double)ix.lz.in / ix.lz.stored : 1.0, ix.lz.raw_chunks,
+        ix.lz.in ? (double)ix.lz.compress_ns / ix.lz.in : 0.0,
+        ix.lz.in ? (double)ix.lz.decompress_ns / ix.lz.in : 0.0,
+        in * 1e3 / wr_ns, out * 1e3 / rd_ns);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const long chunks[] = { 0, 256, 1024, 4096, 16384, 32768 };
+    const char *path = argc > 1 ? argv[1] : "/dev/my_char0";
+    long fifo = argc > 2 ? atol(argv[2]) : 65536;
+    char *text;
+    unsigned int i;
+    int fd;
+
+    text = make_text(TEXT_SIZE);
+    fd = open(path, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+    {
+        perror("open() failed");
+        _exit(1);
+    }
+
+    // logical = bytes held when full, ns/B = kernel lz4 time per input byte
+    printf("%6s %9s %9s %7s %6s %5s %9s %9s %9s %9s\n",
+        "chunk", "physical", "logical", "gain", "ratio", "raw", "comp ns/B", "dec ns/B", "wr MB/s", "rd MB/s");
+    for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        if (chunks[i] + 4 > fifo)
+            break;
+        if (run(fd, text, chunks[i], fifo) != 0)
+            break;
+    }
+    ioctl(fd, FIFO_SET_LZ, 0L);
+    close(fd);
+    free(text);
+    return 0;
+}
@@ -5,49 +5,431 @@
 #include <linux/cdev.h>
 #include <linux/kfifo.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/rcupdate.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/filter.h>
+#include <linux/skbuff.h>
+#include <linux/shrinker.h>
+#include <linux/jiffies.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/mm.h>
+#include <linux/lz4.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/eventfd.h>
+#include <linux/kthread.h>
 #include "pchar_ioctl.h"
+#include "pchar_kapi.h"
+#define CREATE_TRACE_POINTS
+#include "pchar_trace.h"
 
 static int pchar_open(struct inode *pinode, struct file *pfile);
 static int pchar_close(struct inode *pinode, struct file *pfile);
 static ssize_t pchar_read(struct file *pfile, char *ubuf, size_t size, loff_t *poffset);
 static ssize_t pchar_write(struct file *pfile, const char *ubuf, size_t size, loff_t *poffset);
 static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param);
+static int pchar_fsync(struct file *pfile, loff_t start, loff_t end, int datasync);
+static __poll_t pchar_poll(struct file *pfile, poll_table *wait);
+static int pchar_all_open(struct inode *pinode, struct file *pfile);
+static int pchar_all_close(struct inode *pinode, struct file *pfile);
+static ssize_t pchar_all_read(struct file *pfile, char *ubuf, size_t size, loff_t *poffset);
+static __poll_t pchar_all_poll(struct file *pfile, poll_table *wait);
+static long pchar_all_ioctl(struct file *pfile, unsigned int cmd, unsigned long param);
+static int pchar_all_wake(wait_queue_entry_t *wait, unsigned int mode, int sync, void *key);
 
 #define MAX 32
+#define PCHAR_WRR_QUANTUM 16 // bytes granted per unit of lane weight in one wrr round
+#define PCHAR_ALL_QUANTUM 64 // my_char_all bytes per unit of device weight in one record
+#define PCHAR_STAGE_MAX 65536 // largest coalescing buffer
+#define PCHAR_STAGE_DELAY_US 1000 // default coalescing timeout, stage_work rounds it up to a jiffy (10 ms at HZ=100)
+#define PCHAR_BPF_MAX_WRITE 65536 // longer writes are cut to this when a filter is attached
+#define PCHAR_FIFO_MAX (1 << 24) // largest FIFO_RESIZE lane size
+#define PCHAR_ELASTIC_STALLS 2 // writes finding a lane full before it grows
+#define PCHAR_ELASTIC_SHRINK_MS 1000
+#define PCHAR_LZ_CHUNK_MIN 64
+#define PCHAR_LZ_CHUNK_MAX 32768 // record lengths are 16 bit
+
+// registered kernel consumer callback
+struct pchar_ready
+{
+    pchar_ready_fn fn;
+    void *ctx;
+};
+
+// token bucket
+struct pchar_bucket
+{
+    u64 rate; // tokens per second, 0 = unlimited
+    u64 burst;
+    u64 tokens;
+    u64 last_ns; // tokens are filled up to this time
+};
+
+// FIFO_SET_RATE limit of a device or an open file, protected by the device rate_lock
+struct pchar_rate
+{
+    struct pchar_bucket bytes;
+    struct pchar_bucket ops;
+    int policy;
+    rate_count_t count;
+};
 
 // device private struct
 struct pchar_device
 {
-    struct kfifo my_buf;
+    struct kfifo my_buf[PCHAR_MAX_LANES]; // lane 0 = highest priority
     dev_t my_devno;
-    struct cdev my_cdev;    
+    struct cdev my_cdev;
+    struct mutex my_lock; // protects lanes and scheduler state
+    wait_queue_head_t wr_wq;
+    wait_queue_head_t rd_wq;
+    struct pchar_ready __rcu *ready;
+    int nr_lanes;
+    int sched;
+    int weight[PCHAR_MAX_LANES];
+    int deficit[PCHAR_MAX_LANES]; // wrr bytes left for lane in current round
+    int rr_lane; // wrr lane currently being served
+    wait_queue_entry_t all_wait; // hooks rd_wq while my_char_all is open
+    int all_weight; // my_char_all share of this device
+    stats_t stats; // protected by my_lock
+    // FIFO_SET_BPF write filter, replaced under my_lock
+    struct bpf_prog __rcu *filter;
+    unsigned int sample_every;
+    atomic_t sample_seq;
+    atomic64_t bpf_accepted;
+    atomic64_t bpf_dropped;
+    atomic64_t bpf_sampled;
+    atomic64_t bpf_sample_skipped;
+    atomic64_t bpf_dropped_bytes;
+    // fifo memory, protected by my_lock
+    unsigned long mem_bytes; // kfifo bytes of all lanes, counted in mem_used
+    unsigned long mem_max; // cap on mem_bytes, 0 = unlimited
+    unsigned long last_active; // jiffies of last read or write
+    unsigned long trimmed; // times the shrinker cut this device back
+    // FIFO_EXPORT_DMABUF, protected by my_lock
+    struct dma_buf *dmabuf; // live export of dma_lane, cleared on release
+    int dma_lane;
+    struct page *dma_pages; // page backing of dma_lane fifo, kept after release till another lane is exported
+    unsigned int dma_order;
+    unsigned int dma_window; // bytes handed out by FIFO_DMABUF_BEGIN
+    // FIFO_SET_ELASTIC, protected by my_lock
+    elastic_t elastic; // max_size 0 = off
+    unsigned int stalls[PCHAR_MAX_LANES]; // full lane hits since last resize
+    unsigned long low_since[PCHAR_MAX_LANES]; // jiffies lane went under low_pct, 0 = not low
+    elastic_stats_t elastic_stats;
+    // FIFO_SET_LZ compression of lane 0, protected by my_lock
+    unsigned int lz_chunk; // uncompressed bytes per record, 0 = off
+    char *lz_open; // chunk writers are filling
+    unsigned int lz_open_off; // bytes of lz_open already read
+    unsigned int lz_open_len;
+    char *lz_dec; // record readers are draining, decompressed
+    unsigned int lz_dec_off;
+    unsigned int lz_dec_len;
+    char *lz_cbuf; // compressed record
+    void *lz_wrkmem;
+    unsigned long long lz_fifo_logical; // uncompressed bytes of the records in the fifo
+    lz_stats_t lz_stats;
+    spinlock_t rate_lock; // protects rate and the rate of every open file
+    struct pchar_rate rate;
+    struct hrtimer rate_timer; // wakes wr_wq pollers when limited writes may go again
+    // FIFO_FILL_NOTIFY, protected by my_lock
+    struct eventfd_ctx *rise_ev;
+    struct eventfd_ctx *fall_ev;
+    unsigned int rise_pct;
+    unsigned int fall_pct;
+    bool fill_high; // reached rise_pct, next event is the fall
+};
+
+// fifo record of a compressed device, followed by len bytes
+struct pchar_lz_hdr
+{
+    u16 len; // == ulen when the chunk is stored as is
+    u16 ulen;
 };
 
+// per open file state
+struct pchar_file
+{
+    struct pchar_device *pdev;
+    int lane; // lane used by pchar_write
+    // writer side coalescing, off till FIFO_COALESCE
+    struct mutex stage_lock;
+    char *stage_buf;
+    unsigned int stage_size;
+    unsigned int stage_len;
+    unsigned int stage_delay_us;
+    struct delayed_work stage_work; // publishes stage_buf after stage_delay_us
+    struct pchar_rate rate; // FIFO_SET_RATE with per_file, under pdev->rate_lock
+};
+
+static int pchar_stage_publish(struct pchar_file *pfl, bool nonblock);
+static void pchar_stage_timeout(struct work_struct *work);
+static int pchar_mem_reserve(struct pchar_device *pdev, unsigned long bytes);
+static void pchar_mem_settle(struct pchar_device *pdev);
+static void pchar_lane_free(struct pchar_device *pdev, int lane);
+static void pchar_elastic_stall(struct pchar_device *pdev, int lane);
+static void pchar_elastic_grow(struct pchar_device *pdev, int lane, bool full);
+static void pchar_elastic_low(struct pchar_device *pdev);
+static void pchar_bucket_set(struct pchar_bucket *b, u64 rate, u64 burst, u64 now);
+static enum hrtimer_restart pchar_rate_timeout(struct hrtimer *timer);
+static unsigned long pchar_shrink_count(struct shrinker *s, struct shrink_control *sc);
+static unsigned long pchar_shrink_scan(struct shrinker *s, struct shrink_control *sc);
+
 struct file_operations my_fops = {
     .owner = THIS_MODULE,
     .open = pchar_open,
     .release = pchar_close,
     .read = pchar_read,
     .write = pchar_write,
+    .fsync = pchar_fsync,
+    .poll = pchar_poll,
     .unlocked_ioctl = pchar_ioctl
 };
 
+struct file_operations my_all_fops = {
+    .owner = THIS_MODULE,
+    .open = pchar_all_open,
+    .release = pchar_all_close,
+    .read = pchar_all_read,
+    .poll = pchar_all_poll,
+    .unlocked_ioctl = pchar_all_ioctl
+};
+
+// fan-in node my_char_all, minor my_devcnt
+static dev_t all_devno;
+static struct cdev all_cdev;
+static DEFINE_MUTEX(all_lock); // protects all_rr and all_users
+static DECLARE_WAIT_QUEUE_HEAD(all_wq);
+static int all_rr; // next device my_char_all serves
+static int all_users;
 
 static int major;
 static struct class *pclass;
 static int my_devcnt = 3;
 module_param(my_devcnt,int,0100);
+static int my_lanes = 1;
+module_param(my_lanes,int,0444);
+MODULE_PARM_DESC(my_lanes, "priority lanes per device (1..8)");
+static int my_sched = PCHAR_SCHED_STRICT;
+module_param(my_sched,int,0444);
+MODULE_PARM_DESC(my_sched, "default lane scheduling: 0=strict priority, 1=weighted round robin");
+static unsigned long mem_budget;
+module_param(mem_budget,ulong,0644);
+MODULE_PARM_DESC(mem_budget, "fifo bytes allowed for all devices, 0 = unlimited");
+static unsigned long dev_mem_max;
+module_param(dev_mem_max,ulong,0444);
+MODULE_PARM_DESC(dev_mem_max, "default per device fifo byte cap, 0 = unlimited");
+static unsigned int mem_floor = MAX;
+module_param(mem_floor,uint,0644);
+MODULE_PARM_DESC(mem_floor, "lane size the shrinker trims idle devices back to");
+static unsigned int shrink_idle_ms = 5000;
+module_param(shrink_idle_ms,uint,0644);
+MODULE_PARM_DESC(shrink_idle_ms, "devices without reads or writes for this long may be trimmed");
+static atomic_long_t mem_used; // sum of mem_bytes of all devices
 struct pchar_device *my_devices;
 
+static struct shrinker pchar_shrinker = {
+    .count_objects = pchar_shrink_count,
+    .scan_objects = pchar_shrink_scan,
+    .seeks = DEFAULT_SEEKS
+};
+
+// /sys/class/multidev_char/my_charN/{mem_bytes,mem_max}
+static ssize_t mem_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(pdev->mem_bytes));
+}
+static DEVICE_ATTR_RO(mem_bytes);
+
+static ssize_t mem_max_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(pdev->mem_max));
+}
+
+// new cap applies to later FIFO_RESIZE, current lanes are kept
+static ssize_t mem_max_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    unsigned long val;
+    int ret;
+
+    ret = kstrtoul(buf, 0, &val);
+    if (ret != 0)
+        return ret;
+    mutex_lock(&pdev->my_lock);
+    pdev->mem_max = val;
+    mutex_unlock(&pdev->my_lock);
+    return count;
+}
+static DEVICE_ATTR_RW(mem_max);
+
+static ssize_t trimmed_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(pdev->trimmed));
+}
+static DEVICE_ATTR_RO(trimmed);
+
+static struct attribute *pchar_mem_attrs[] = {
+    &dev_attr_mem_bytes.attr,
+    &dev_attr_mem_max.attr,
+    &dev_attr_trimmed.attr,
+    NULL
+};
+static const struct attribute_group pchar_mem_group = {
+    .attrs = pchar_mem_attrs
+};
+
+// /sys/class/multidev_char/my_charN/rate/, the device limit of FIFO_SET_RATE
+static ssize_t pchar_rate_show(struct device *dev, char *buf, u64 *val)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    u64 v;
+
+    spin_lock(&pdev->rate_lock);
+    v = *val;
+    spin_unlock(&pdev->rate_lock);
+    return sysfs_emit(buf, "%llu\n", v);
+}
+
+// new rate with one second of burst
+static ssize_t pchar_rate_store(struct device *dev, const char *buf, size_t count, struct pchar_bucket *b)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    u64 val;
+    int ret;
+
+    ret = kstrtoull(buf, 0, &val);
+    if (ret != 0)
+        return ret;
+    spin_lock(&pdev->rate_lock);
+    pchar_bucket_set(b, val, 0, ktime_get_ns());
+    spin_unlock(&pdev->rate_lock);
+    return count;
+}
+
+static ssize_t bytes_per_sec_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    return pchar_rate_show(dev, buf, &pdev->rate.bytes.rate);
+}
+
+static ssize_t bytes_per_sec_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    return pchar_rate_store(dev, buf, count, &pdev->rate.bytes);
+}
+static DEVICE_ATTR_RW(bytes_per_sec);
+
+static ssize_t ops_per_sec_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    return pchar_rate_show(dev, buf, &pdev->rate.ops.rate);
+}
+
+static ssize_t ops_per_sec_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    return pchar_rate_store(dev, buf, count, &pdev->rate.ops);
+}
+static DEVICE_ATTR_RW(ops_per_sec);
+
+static ssize_t policy_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    return sysfs_emit(buf, "%s\n", READ_ONCE(pdev->rate.policy) == PCHAR_RATE_EAGAIN ? "eagain" : "sleep");
+}
+
+static ssize_t policy_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    int policy;
+
+    if (sysfs_streq(buf, "sleep"))
+        policy = PCHAR_RATE_SLEEP;
+    else if (sysfs_streq(buf, "eagain"))
+        policy = PCHAR_RATE_EAGAIN;
+    else
+        return -EINVAL;
+    spin_lock(&pdev->rate_lock);
+    pdev->rate.policy = policy;
+    spin_unlock(&pdev->rate_lock);
+    return count;
+}
+static DEVICE_ATTR_RW(policy);
+
+static ssize_t throttled_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    return pchar_rate_show(dev, buf, &pdev->rate.count.throttled);
+}
+static DEVICE_ATTR_RO(throttled);
+
+static ssize_t throttle_ns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    return pchar_rate_show(dev, buf, &pdev->rate.count.throttle_ns);
+}
+static DEVICE_ATTR_RO(throttle_ns);
+
+static ssize_t refused_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct pchar_device *pdev = dev_get_drvdata(dev);
+    return pchar_rate_show(dev, buf, &pdev->rate.count.refused);
+}
+static DEVICE_ATTR_RO(refused);
+
+static struct attribute *pchar_rate_attrs[] = {
+    &dev_attr_bytes_per_sec.attr,
+    &dev_attr_ops_per_sec.attr,
+    &dev_attr_policy.attr,
+    &dev_attr_throttled.attr,
+    &dev_attr_throttle_ns.attr,
+    &dev_attr_refused.attr,
+    NULL
+};
+
+static const struct attribute_group pchar_rate_group = {
+    .name = "rate",
+    .attrs = pchar_rate_attrs
+};
+
+static const struct attribute_group *pchar_dev_groups[] = {
+    &pchar_mem_group,
+    &pchar_rate_group,
+    NULL
+};
+
+// /sys/class/multidev_char/mem_used
+static ssize_t mem_used_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%ld\n", atomic_long_read(&mem_used));
+}
+static CLASS_ATTR_RO(mem_used);
+
 static __init int pchar_init(void)
 {
     dev_t devno;
-    int ret, i,minor;
+    int ret, i, lane, minor;
     struct device *pdevices;
 
     printk(KERN_INFO "%s : pchar_init called\n", THIS_MODULE->name);
 
-    my_devices = (struct pchar_device *)kmalloc(my_devcnt * sizeof(struct pchar_device), GFP_KERNEL);
+    if (my_lanes < 1 || my_lanes > PCHAR_MAX_LANES || (my_sched != PCHAR_SCHED_STRICT && my_sched != PCHAR_SCHED_WRR))
+    {
+        printk(KERN_ERR "%s : invalid my_lanes=%d or my_sched=%d\n", THIS_MODULE->name, my_lanes, my_sched);
+        return -EINVAL;
+    }
+
+    // zeroed so that kfifo_free() is safe on lanes never allocated
+    my_devices = kcalloc(my_devcnt, sizeof(struct pchar_device), GFP_KERNEL);
     if(my_devices == NULL)
     {
         ret = -ENOMEM;
@@ -58,17 +440,36 @@ static __init int pchar_init(void)
 
     for (i = 0; i < my_devcnt; i++)
     {
-        ret = kfifo_alloc(&my_devices[i].my_buf, MAX, GFP_KERNEL);
-        if (ret != 0)
+        mutex_init(&my_devices[i].my_lock);
+        init_waitqueue_head(&my_devices[i].wr_wq);
+        init_waitqueue_head(&my_devices[i].rd_wq);
+        spin_lock_init(&my_devices[i].rate_lock);
+        hrtimer_init(&my_devices[i].rate_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+        my_devices[i].rate_timer.function = pchar_rate_timeout;
+        init_waitqueue_func_entry(&my_devices[i].all_wait, pchar_all_wake);
+        my_devices[i].all_weight = 1;
+        my_devices[i].nr_lanes = my_lanes;
+        my_devices[i].sched = my_sched;
+        my_devices[i].mem_max = dev_mem_max;
+        my_devices[i].last_active = jiffies;
+        for (lane = 0; lane < my_lanes; lane++)
         {
-            printk(KERN_INFO "%s : kfifo_alloc() is failed for device %d\n", THIS_MODULE->name, i);
-            goto kfifo_alloc_failed;
+            // higher priority lanes get a bigger share under wrr
+            my_devices[i].weight[lane] = my_lanes - lane;
+            ret = kfifo_alloc(&my_devices[i].my_buf[lane], MAX, GFP_KERNEL_ACCOUNT);
+            if (ret != 0)
+            {
+                printk(KERN_INFO "%s : kfifo_alloc() is failed for device %d lane %d\n", THIS_MODULE->name, i, lane);
+                goto kfifo_alloc_failed;
+            }
         }
+        pchar_mem_settle(&my_devices[i]);
     }
     printk(KERN_INFO "%s : kfifo_alloc is success\n", THIS_MODULE->name);
 
     // devname = my_char
-    ret = alloc_chrdev_region(&devno, 0, my_devcnt, "my_char");
+    // one extra minor for my_char_all
+    ret = alloc_chrdev_region(&devno, 0, my_devcnt + 1, "my_char");
     if (ret != 0)
     {
         printk(KERN_INFO "%s : alloc_chrdev_region_failed\n", THIS_MODULE->name);
@@ -86,11 +487,17 @@ static __init int pchar_init(void)
         goto class_create_failed;
     }
     printk(KERN_INFO "%s : class_create is success\n", THIS_MODULE->name);
+    ret = class_create_file(pclass, &class_attr_mem_used);
+    if (ret != 0)
+    {
+        printk(KERN_ERR "%s : class_create_file is failed\n", THIS_MODULE->name);
+        goto class_file_failed;
+    }
 
     for (i = 0; i < my_devcnt; i++)
     {
         my_devices[i].my_devno = MKDEV(major, i);
-        pdevices = device_create(pclass, NULL, my_devices[i].my_devno, NULL, "my_char%d", i);
+        pdevices = device_create_with_groups(pclass, NULL, my_devices[i].my_devno, &my_devices[i], pchar_dev_groups, "my_char%d", i);
         if (IS_ERR(pdevices))
         {
             printk(KERN_ERR "%s : device_create is failed for device %d\n", THIS_MODULE->name, i);
@@ -113,8 +520,38 @@ static __init int pchar_init(void)
     }
     printk(KERN_INFO "%s : cdev_add is success\n", THIS_MODULE->name);
 
+    all_devno = MKDEV(major, my_devcnt);
+    pdevices = device_create(pclass, NULL, all_devno, NULL, "my_char_all");
+    if (IS_ERR(pdevices))
+    {
+        printk(KERN_ERR "%s : device_create is failed for my_char_all\n", THIS_MODULE->name);
+        ret = -1;
+        goto all_device_create_failed;
+    }
+    cdev_init(&all_cdev, &my_all_fops);
+    ret = cdev_add(&all_cdev, all_devno, 1);
+    if (ret != 0)
+    {
+        printk(KERN_INFO "%s: cdev_add is failed for my_char_all\n", THIS_MODULE->name);
+        goto all_cdev_add_failed;
+    }
+    printk(KERN_INFO "%s : my_char_all devno= %d\n", THIS_MODULE->name, all_devno);
+
+    ret = register_shrinker(&pchar_shrinker, "pchar-fifo");
+    if (ret != 0)
+    {
+        printk(KERN_ERR "%s : register_shrinker is failed\n", THIS_MODULE->name);
+        goto shrinker_failed;
+    }
+
     return 0;
 
+shrinker_failed:
+    cdev_del(&all_cdev);
+all_cdev_add_failed:
+    device_destroy(pclass, all_devno);
+all_device_create_failed:
+    i = my_devcnt;
 cdev_add_failed:
     for (i = i - 1; i >= 0; i--)
         cdev_del(&my_devices[i].my_cdev);
@@ -124,15 +561,17 @@ device_create_failed:
     {
         device_destroy(pclass, my_devices[i].my_devno);
     }
+    class_remove_file(pclass, &class_attr_mem_used);
+class_file_failed:
     class_destroy(pclass);
 class_create_failed:
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, my_devcnt + 1);
 alloc_chrdev_failed:
-    i = my_devcnt;
 kfifo_alloc_failed:
-    for (i = my_devcnt - 1; i >= 0; i++)
+    for (i = my_devcnt - 1; i >= 0; i--)
     {
-        kfifo_free(&my_devices[i].my_buf);
+        for (lane = 0; lane < PCHAR_MAX_LANES; lane++)
+            kfifo_free(&my_devices[i].my_buf[lane]);
     }
     kfree(my_devices);
 my_device_kmalloc_failed:
@@ -141,9 +580,12 @@ my_device_kmalloc_failed:
 
 static __exit void pchar_exit(void)
 {
-    int i;
+    int i, lane;
     dev_t devno=MKDEV(major,0);
     printk(KERN_INFO "%s : pchar_exit is called\n", THIS_MODULE->name);
+    unregister_shrinker(&pchar_shrinker);
+    cdev_del(&all_cdev);
+    device_destroy(pclass, all_devno);
     for (i = my_devcnt - 1; i >= 0; i--)
         cdev_del(&my_devices[i].my_cdev);
     printk(KERN_INFO "%s : cdev_del remove devices from kernle db\n", THIS_MODULE->name);
@@ -152,13 +594,26 @@ static __exit void pchar_exit(void)
         device_destroy(pclass, my_devices[i].my_devno);
     }
     printk(KERN_INFO "%s : device_destroy() destroy device files\n", THIS_MODULE->name);
+    class_remove_file(pclass, &class_attr_mem_used);
     class_destroy(pclass);
     printk(KERN_INFO "%s : class_destroy() destroy device class\n", THIS_MODULE->name);
-    unregister_chrdev_region(devno,my_devcnt);
+    unregister_chrdev_region(devno,my_devcnt + 1);
     printk(KERN_INFO "%s : unregister_chrdev_region is success\n", THIS_MODULE->name);
     for (i = my_devcnt-1; i >= 0; i--)
     {
-        kfifo_free(&my_devices[i].my_buf);
+        hrtimer_cancel(&my_devices[i].rate_timer);
+        for (lane = 0; lane < my_devices[i].nr_lanes; lane++)
+            pchar_lane_free(&my_devices[i], lane);
+        kfree(my_devices[i].lz_open);
+        kfree(my_devices[i].lz_dec);
+        kfree(my_devices[i].lz_cbuf);
+        kfree(my_devices[i].lz_wrkmem);
+        if (my_devices[i].rise_ev != NULL)
+            eventfd_ctx_put(my_devices[i].rise_ev);
+        if (my_devices[i].fall_ev != NULL)
+            eventfd_ctx_put(my_devices[i].fall_ev);
+        if (rcu_access_pointer(my_devices[i].filter) != NULL)
+            bpf_prog_put(rcu_dereference_protected(my_devices[i].filter, 1));
     }
     printk(KERN_INFO "%s : kfifo free all buf are release\n", THIS_MODULE->name);
     kfree(my_devices);
@@ -166,115 +621,1969 @@ static __exit void pchar_exit(void)
 }
 
 static int pchar_open(struct inode *pinode, struct file *pfile)
-{   
-    printk(KERN_INFO "%s : pchar_open is called\n",THIS_MODULE->name);
-    struct pchar_device *pdev = 
+{
+    struct pchar_device *pdev =
     container_of(pinode->i_cdev,struct pchar_device,my_cdev);
-    pfile->private_data = pdev;
+    struct pchar_file *pfl;
+    printk(KERN_INFO "%s : pchar_open is called\n",THIS_MODULE->name);
+    pfl = kzalloc(sizeof(struct pchar_file), GFP_KERNEL);
+    if (pfl == NULL)
+        return -ENOMEM;
+    pfl->pdev = pdev;
+    // plain writers go to the lowest priority (bulk) lane
+    pfl->lane = pdev->nr_lanes - 1;
+    mutex_init(&pfl->stage_lock);
+    INIT_DELAYED_WORK(&pfl->stage_work, pchar_stage_timeout);
+    pfile->private_data = pfl;
     return 0;
 }
 
 static int pchar_close(struct inode *pinode, struct file *pfile)
 {
+    struct pchar_file *pfl = (struct pchar_file*)pfile->private_data;
     printk(KERN_INFO "%s:char_close is called\n",THIS_MODULE->name);
+    cancel_delayed_work_sync(&pfl->stage_work);
+    // staged data is published without waiting, close() must not hang on a full device
+    mutex_lock(&pfl->stage_lock);
+    pchar_stage_publish(pfl, true);
+    if (pfl->stage_len != 0)
+    {
+        mutex_lock(&pfl->pdev->my_lock);
+        pfl->pdev->stats.stage_dropped += pfl->stage_len;
+        mutex_unlock(&pfl->pdev->my_lock);
+        printk(KERN_ERR "%s : dropped %u staged bytes on close\n", THIS_MODULE->name, pfl->stage_len);
+    }
+    mutex_unlock(&pfl->stage_lock);
+    kfree(pfl->stage_buf);
+    kfree(pfl);
     return 0;
 }
 
-static ssize_t pchar_read(struct file *pfile, char *ubuf, size_t size, loff_t *poffset)
+// copy out of a lane fifo into user or kernel memory
+static int pchar_lane_out(struct kfifo *fifo, void *buf, unsigned int len, bool to_user, unsigned int *copied)
 {
-    int nbytes=0,ret;
-    printk(KERN_INFO "%s : pchar_read is called\n", THIS_MODULE->name);
-    struct pchar_device *pdev = (struct pchar_device*)pfile->private_data;
-    ret = kfifo_to_user(&pdev->my_buf,ubuf,size, &nbytes);
-    if(ret < 0){
-        printk(KERN_ERR"%s: pchar_read is failed to copy data from user to kernel space\n",THIS_MODULE->name);
-        return ret;
+    if (!to_user)
+    {
+        *copied = kfifo_out(fifo, buf, len);
+        return 0;
     }
-    printk(KERN_INFO"%s : bytes read from user space %d\n",THIS_MODULE->name,nbytes);
-    return nbytes;
+    return kfifo_to_user(fifo, (char __user *)buf, len, copied);
 }
 
-static ssize_t pchar_write(struct file *pfile, const char *ubuf, size_t size, loff_t *poffset)
+// copy from user or kernel memory into a lane fifo
+static int pchar_lane_in(struct kfifo *fifo, const void *buf, unsigned int len, bool from_user, unsigned int *copied)
 {
-    int nbytes=size,ret;
-    printk(KERN_INFO "%s : pchar_write is called\n", THIS_MODULE->name);
-    struct pchar_device *pdev = (struct pchar_device*)pfile->private_data; 
-    ret = kfifo_from_user(&pdev->my_buf,ubuf,size, &nbytes);
-    if(ret < 0){
-        printk(KERN_ERR"%s: pchar_write is failed to copy data from kernel to user space\n",THIS_MODULE->name);
-        return ret;
+    if (!from_user)
+    {
+        *copied = kfifo_in(fifo, buf, len);
+        return 0;
     }
-    printk(KERN_INFO"%s : bytes write to user space %d\n", THIS_MODULE->name,nbytes);
-    return nbytes;
+    return kfifo_from_user(fifo, (const char __user *)buf, len, copied);
 }
 
-static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param){
-    info_t info;
+/*
+ * FIFO_SET_LZ devices. Writers fill lz_open; each full chunk is lz4
+ * compressed into one record of lane 0. Readers get the decompressed
+ * record in lz_dec first, then the next records, and when nothing
+ * compressed is left the tail of lz_open itself, so byte order is kept
+ * and a reader never waits for a chunk to fill up.
+ */
+static bool pchar_lz_empty(struct pchar_device *pdev)
+{
+    return kfifo_is_empty(&pdev->my_buf[0]) && pdev->lz_dec_off == pdev->lz_dec_len && pdev->lz_open_off == pdev->lz_open_len;
+}
+
+static unsigned long long pchar_lz_logical(struct pchar_device *pdev)
+{
+    return pdev->lz_fifo_logical + (pdev->lz_dec_len - pdev->lz_dec_off) + (pdev->lz_open_len - pdev->lz_open_off);
+}
+
+// move the open chunk into the fifo; -ENOSPC keeps it open till readers make room
+static int pchar_lz_flush(struct pchar_device *pdev)
+{
+    struct kfifo *fifo = &pdev->my_buf[0];
+    struct pchar_lz_hdr hdr;
+    const char *data = pdev->lz_open + pdev->lz_open_off;
+    u64 start;
+    int clen;
+
+    hdr.ulen = pdev->lz_open_len - pdev->lz_open_off;
+    if (hdr.ulen != 0)
+    {
+        start = ktime_get_ns();
+        clen = LZ4_compress_default(data, pdev->lz_cbuf, hdr.ulen, LZ4_COMPRESSBOUND(pdev->lz_chunk), pdev->lz_wrkmem);
+        pdev->lz_stats.compress_ns += ktime_get_ns() - start;
+        hdr.len = hdr.ulen;
+        if (clen > 0 && clen < hdr.ulen)
+        {
+            hdr.len = clen;
+            data = pdev->lz_cbuf;
+        }
+        if (kfifo_avail(fifo) < sizeof(hdr) + hdr.len)
+            return -ENOSPC;
+        kfifo_in(fifo, &hdr, sizeof(hdr));
+        kfifo_in(fifo, data, hdr.len);
+        pdev->lz_fifo_logical += hdr.ulen;
+        pdev->lz_stats.in += hdr.ulen;
+        pdev->lz_stats.stored += sizeof(hdr) + hdr.len;
+        pdev->lz_stats.chunks++;
+        if (hdr.len == hdr.ulen)
+            pdev->lz_stats.raw_chunks++;
+    }
+    pdev->lz_open_off = 0;
+    pdev->lz_open_len = 0;
+    return 0;
+}
+
+// pchar_lane_in of a compressed device
+static int pchar_lz_in(struct pchar_device *pdev, const void *buf, unsigned int len, bool from_user, unsigned int *copied)
+{
+    unsigned int n;
+
+    *copied = 0;
+    while (*copied < len && pdev->lz_open_len < pdev->lz_chunk)
+    {
+        n = min(len - *copied, pdev->lz_chunk - pdev->lz_open_len);
+        if (!from_user)
+            memcpy(pdev->lz_open + pdev->lz_open_len, buf + *copied, n);
+        else if (copy_from_user(pdev->lz_open + pdev->lz_open_len, (const char __user *)buf + *copied, n))
+            return -EFAULT;
+        pdev->lz_open_len += n;
+        *copied += n;
+        if (pdev->lz_open_len == pdev->lz_chunk)
+            pchar_lz_flush(pdev);
+    }
+    return 0;
+}
+
+// decompress the next fifo record into lz_dec
+static int pchar_lz_next(struct pchar_device *pdev)
+{
+    struct kfifo *fifo = &pdev->my_buf[0];
+    struct pchar_lz_hdr hdr;
+    u64 start;
     int ret;
-    struct pchar_device *pdev = (struct pchar_device *)pfile->private_data;
-    switch(cmd){
-        case FIFO_CLEAR:
-            printk(KERN_INFO"%s : pchar_ioctl() fifo clear\n", THIS_MODULE->name);
-            kfifo_reset(&pdev->my_buf);
-            break;
 
-        case FIFO_INFO:
-            printk(KERN_INFO"%s : pchar_ioctl() fifo info\n", THIS_MODULE->name);
-            info.size = kfifo_size(&pdev->my_buf);
-            info.avail = kfifo_avail(&pdev->my_buf);
-            info.len = kfifo_len(&pdev->my_buf);
-            ret = copy_to_user((void*)param,&info,sizeof(info_t));
+    if (kfifo_out(fifo, &hdr, sizeof(hdr)) != sizeof(hdr))
+        return -EIO;
+    pdev->lz_fifo_logical -= hdr.ulen;
+    pdev->lz_dec_off = 0;
+    pdev->lz_dec_len = 0;
+    if (hdr.len == hdr.ulen)
+    {
+        pdev->lz_dec_len = kfifo_out(fifo, pdev->lz_dec, hdr.len);
+    }
+    else
+    {
+        kfifo_out(fifo, pdev->lz_cbuf, hdr.len);
+        start = ktime_get_ns();
+        ret = LZ4_decompress_safe(pdev->lz_cbuf, pdev->lz_dec, hdr.len, pdev->lz_chunk);
+        pdev->lz_stats.decompress_ns += ktime_get_ns() - start;
+        if (ret != hdr.ulen)
+        {
+            printk(KERN_ERR "%s : corrupt lz4 record, %u bytes lost\n", THIS_MODULE->name, hdr.ulen);
+            return -EIO;
+        }
+        pdev->lz_dec_len = hdr.ulen;
+    }
+    // a writer may be waiting for room for the open chunk
+    if (pdev->lz_open_len == pdev->lz_chunk)
+        pchar_lz_flush(pdev);
+    return 0;
+}
+
+// pchar_read_strict of a compressed device
+static ssize_t pchar_lz_out(struct pchar_device *pdev, char *buf, size_t size, bool to_user)
+{
+    unsigned int n, total = 0, *off;
+    char *src;
+    int ret;
+
+    while (total < size)
+    {
+        if (pdev->lz_dec_off == pdev->lz_dec_len && !kfifo_is_empty(&pdev->my_buf[0]))
+        {
+            ret = pchar_lz_next(pdev);
+            if (ret < 0)
+                return total ? total : ret;
+        }
+        if (pdev->lz_dec_off < pdev->lz_dec_len)
+        {
+            src = pdev->lz_dec + pdev->lz_dec_off;
+            n = min_t(size_t, size - total, pdev->lz_dec_len - pdev->lz_dec_off);
+            off = &pdev->lz_dec_off;
+        }
+        else if (pdev->lz_open_off < pdev->lz_open_len)
+        {
+            src = pdev->lz_open + pdev->lz_open_off;
+            n = min_t(size_t, size - total, pdev->lz_open_len - pdev->lz_open_off);
+            off = &pdev->lz_open_off;
+        }
+        else
+        {
             break;
+        }
+        if (!to_user)
+            memcpy(buf + total, src, n);
+        else if (copy_to_user((char __user *)buf + total, src, n))
+            return total ? total : -EFAULT;
+        *off += n;
+        total += n;
+        // open chunk read up, writers get all of it again
+        if (pdev->lz_open_off == pdev->lz_open_len)
+            pdev->lz_open_off = pdev->lz_open_len = 0;
+    }
+    return total;
+}
 
-        case FIFO_RESIZE:
-            
-            void *temp_buf;
-            printk(KERN_INFO"%s : pchar_ioctl() fifo resize\n", THIS_MODULE->name);
-            // allocate temp buffer of fifo length - kmalloc(), kifo_len()
-            int len = kfifo_len(&pdev->my_buf);
-            temp_buf = kmalloc(len ,GFP_KERNEL);
-            if(temp_buf == NULL)
-            {
-                ret = -ENOMEM;
-                printk(KERN_INFO "%s: kmalloc() is failed\n", THIS_MODULE->name);
-            }
-            printk(KERN_INFO"%s : pchar_ioctl() kmalloc done\n", THIS_MODULE->name);
-            // copy fifo data into that buffer - kfifo_out()
-            ret = kfifo_out(&pdev->my_buf,temp_buf,len);
-            if (ret == 0){
-                printk(KERN_ERR"%s: kfifo_out failed \n",THIS_MODULE->name);
-                kfree(temp_buf);
-            }
-            printk(KERN_INFO"%s : pchar_ioctl() kfifo_out done\n", THIS_MODULE->name);
-            // release kfifo memory - kfifo_free()
-            kfifo_free(&pdev->my_buf);
-            printk(KERN_INFO"%s : pchar_ioctl() kfifo free done\n", THIS_MODULE->name);
-            // allocate kfifo with new size - kfifo_alloc() with param
-            ret = kfifo_alloc(&pdev->my_buf,param,GFP_KERNEL);
-            if (ret != 0)
-            {
-                printk(KERN_INFO "%s : kfifo_alloc() is failed\n", THIS_MODULE->name);
-                kfree(temp_buf);
-            }
-            printk(KERN_INFO"%s : pchar_ioctl() kfifo_alloc done\n", THIS_MODULE->name);
-            // copy temp buffer data back to fifo - kfifo_in()
-            ret = kfifo_in(&pdev->my_buf,temp_buf,len);
-            if (ret == 0){
-                printk(KERN_ERR"%s: kfifo_out failed \n",THIS_MODULE->name);
-                kfree(temp_buf);
-            }
-            printk(KERN_INFO"%s : pchar_ioctl() kfifo in done\n", THIS_MODULE->name);
-            // release temp buffer - kfree()
-            kfree(temp_buf);
-            printk(KERN_INFO"%s : pchar_ioctl() kfree done\n", THIS_MODULE->name);
-            info.size = kfifo_size(&pdev->my_buf);
-            info.avail = kfifo_avail(&pdev->my_buf);
-            info.len = kfifo_len(&pdev->my_buf);
-            printk(KERN_INFO"%s : pchar_ioctl() info.size=%d, info.avail=%d, info.len=%d\n", THIS_MODULE->name,info.size,info.avail,info.len);
-            ret = copy_to_user((void*)param,&info,sizeof(info_t));
+// an exported lane is drained only through FIFO_DMABUF_BEGIN/END
+static bool pchar_lane_exported(struct pchar_device *pdev, int lane)
+{
+    return READ_ONCE(pdev->dmabuf) != NULL && lane == pdev->dma_lane;
+}
+
+static bool pchar_is_empty(struct pchar_device *pdev)
+{
+    int lane;
+    if (READ_ONCE(pdev->lz_chunk) != 0)
+        return pchar_lz_empty(pdev);
+    for (lane = 0; lane < pdev->nr_lanes; lane++)
+    {
+        if (!kfifo_is_empty(&pdev->my_buf[lane]) && !pchar_lane_exported(pdev, lane))
+            return false;
+    }
+    return true;
+}
+
+static unsigned int pchar_len(struct pchar_device *pdev)
+{
+    unsigned int len = 0;
+    int lane;
+    for (lane = 0; lane < pdev->nr_lanes; lane++)
+        len += kfifo_len(&pdev->my_buf[lane]);
+    return len;
+}
+
+// strict priority: a lane is read only when all higher priority lanes are empty
+static ssize_t pchar_read_strict(struct pchar_device *pdev, char *buf, size_t size, bool to_user)
+{
+    unsigned int copied, total = 0;
+    int lane, ret;
+
+    for (lane = 0; lane < pdev->nr_lanes && total < size; lane++)
+    {
+        if (pchar_lane_exported(pdev, lane))
+            continue;
+        ret = pchar_lane_out(&pdev->my_buf[lane], buf + total, size - total, to_user, &copied);
+        if (ret < 0)
+            return total ? total : ret;
+        total += copied;
+    }
+    return total;
+}
+
+// deficit round robin: each turn a lane may give weight * PCHAR_WRR_QUANTUM bytes
+static ssize_t pchar_read_wrr(struct pchar_device *pdev, char *buf, size_t size, bool to_user)
+{
+    unsigned int copied, chunk, total = 0;
+    int lane, idle = 0, ret;
+
+    while (total < size && idle < pdev->nr_lanes)
+    {
+        lane = pdev->rr_lane;
+        if (kfifo_is_empty(&pdev->my_buf[lane]) || pchar_lane_exported(pdev, lane))
+        {
+            pdev->deficit[lane] = 0;
+            pdev->rr_lane = (lane + 1) % pdev->nr_lanes;
+            idle++;
+            continue;
+        }
+        idle = 0;
+        // deficit left over means the previous read ran out of user buffer mid turn
+        if (pdev->deficit[lane] == 0)
+            pdev->deficit[lane] = pdev->weight[lane] * PCHAR_WRR_QUANTUM;
+        chunk = min_t(size_t, pdev->deficit[lane], size - total);
+        ret = pchar_lane_out(&pdev->my_buf[lane], buf + total, chunk, to_user, &copied);
+        if (ret < 0)
+            return total ? total : ret;
+        total += copied;
+        pdev->deficit[lane] -= copied;
+        if (pdev->deficit[lane] == 0 || kfifo_is_empty(&pdev->my_buf[lane]))
+        {
+            pdev->deficit[lane] = 0;
+            pdev->rr_lane = (lane + 1) % pdev->nr_lanes;
+        }
+    }
+    return total;
+}
+
+/*
+ * Signal FIFO_FILL_NOTIFY eventfds when the fill level crossed a
+ * threshold since the last call. Each crossing fires once: after a rise
+ * only a fall under fall_pct is reported and the other way round.
+ * Caller holds my_lock.
+ */
+static void pchar_fill_check(struct pchar_device *pdev)
+{
+    u64 len = 0, size = 0;
+    int lane;
+
+    if (pdev->rise_ev == NULL && pdev->fall_ev == NULL)
+        return;
+    for (lane = 0; lane < pdev->nr_lanes; lane++)
+    {
+        len += kfifo_len(&pdev->my_buf[lane]);
+        size += kfifo_size(&pdev->my_buf[lane]);
+    }
+    if (!pdev->fill_high && len * 100 >= pdev->rise_pct * size)
+    {
+        pdev->fill_high = true;
+        if (pdev->rise_ev != NULL)
+            eventfd_signal(pdev->rise_ev, 1);
+    }
+    else if (pdev->fill_high && len * 100 < pdev->fall_pct * size)
+    {
+        pdev->fill_high = false;
+        if (pdev->fall_ev != NULL)
+            eventfd_signal(pdev->fall_ev, 1);
+    }
+}
+
+// read with the device's scheduling; caller holds my_lock
+static ssize_t pchar_read_locked(struct pchar_device *pdev, char *buf, size_t size, bool to_user)
+{
+    if (pdev->lz_chunk != 0)
+        return pchar_lz_out(pdev, buf, size, to_user);
+    if (pdev->sched == PCHAR_SCHED_WRR)
+        return pchar_read_wrr(pdev, buf, size, to_user);
+    return pchar_read_strict(pdev, buf, size, to_user);
+}
+
+// a writer to this lane has to wait
+static bool pchar_lane_full(struct pchar_device *pdev, int lane)
+{
+    if (READ_ONCE(pdev->lz_chunk) != 0)
+        return pdev->lz_open_len == pdev->lz_chunk;
+    return kfifo_is_full(&pdev->my_buf[lane]);
+}
+
+static void pchar_notify_ready(struct pchar_device *pdev)
+{
+    struct pchar_ready *ready;
+
+    rcu_read_lock();
+    ready = rcu_dereference(pdev->ready);
+    if (ready != NULL)
+        ready->fn(pdev, ready->ctx);
+    rcu_read_unlock();
+}
+
+// common read path of file and kernel consumers
+static ssize_t pchar_dequeue(struct pchar_device *pdev, void *buf, size_t size, bool to_user, bool nonblock)
+{
+    ssize_t nbytes;
+    int ret;
+
+    if (size == 0)
+        return 0;
+
+    while (1)
+    {
+        if (nonblock && pchar_is_empty(pdev))
+            return -EAGAIN;
+        ret = wait_event_interruptible(pdev->rd_wq, !pchar_is_empty(pdev)); // interruptible sleep
+        if (ret != 0)
+            return -ERESTARTSYS;
+
+        mutex_lock(&pdev->my_lock);
+        nbytes = pchar_read_locked(pdev, buf, size, to_user);
+        if (nbytes > 0)
+        {
+            pdev->stats.reads++;
+            pdev->stats.bytes_out += nbytes;
+            pchar_fill_check(pdev);
+        }
+        pdev->last_active = jiffies;
+        if (pdev->elastic.max_size != 0)
+            pchar_elastic_low(pdev);
+        mutex_unlock(&pdev->my_lock);
+        // another reader may have emptied the device since wakeup
+        if (nbytes != 0)
             break;
-        default:
-            printk(KERN_INFO"%s : pchar_ioctl() unspported cmd\n", THIS_MODULE->name);
+    }
+    if (nbytes > 0)
+        wake_up_interruptible(&pdev->wr_wq);
+    return nbytes;
+}
+
+// common write path of file and kernel producers
+static ssize_t pchar_enqueue(struct pchar_device *pdev, int lane, const void *buf, size_t size, bool from_user, bool nonblock)
+{
+    struct kfifo *fifo = &pdev->my_buf[lane];
+    unsigned int nbytes;
+    int ret;
+
+    if (size == 0)
+        return 0;
+
+    while (1)
+    {
+        if (kfifo_is_full(fifo) && READ_ONCE(pdev->elastic.max_size) != 0)
+            pchar_elastic_stall(pdev, lane);
+        if (nonblock && pchar_lane_full(pdev, lane))
+            return -EAGAIN;
+        ret = wait_event_interruptible(pdev->wr_wq, !pchar_lane_full(pdev, lane)); // interruptible sleep
+        if (ret != 0)
+            return -ERESTARTSYS;
+
+        mutex_lock(&pdev->my_lock);
+        if (pdev->lz_chunk != 0)
+            ret = pchar_lz_in(pdev, buf, size, from_user, &nbytes);
+        else
+            ret = pchar_lane_in(fifo, buf, size, from_user, &nbytes);
+        if (nbytes > 0)
+        {
+            pdev->stats.writes++;
+            pdev->stats.bytes_in += nbytes;
+            pchar_fill_check(pdev);
+        }
+        pdev->last_active = jiffies;
+        if (pdev->elastic.max_size != 0 && nbytes > 0)
+            pchar_elastic_grow(pdev, lane, false);
+        mutex_unlock(&pdev->my_lock);
+        if (ret < 0)
+            return ret;
+        if (nbytes != 0)
+            break;
+    }
+    if (nbytes > 0)
+    {
+        wake_up_interruptible(&pdev->rd_wq);
+        pchar_notify_ready(pdev);
+    }
+    return nbytes;
+}
+
+// push staged bytes into the device as one batch; caller holds stage_lock
+static int pchar_stage_publish(struct pchar_file *pfl, bool nonblock)
+{
+    struct pchar_device *pdev = pfl->pdev;
+    unsigned int done = 0;
+    ssize_t ret = 0;
+
+    while (done < pfl->stage_len)
+    {
+        ret = pchar_enqueue(pdev, pfl->lane, pfl->stage_buf + done, pfl->stage_len - done, false, nonblock);
+        if (ret < 0)
+            break;
+        done += ret;
+    }
+    if (done == 0)
+        return ret < 0 ? ret : 0;
+
+    mutex_lock(&pdev->my_lock);
+    pdev->stats.batches++;
+    mutex_unlock(&pdev->my_lock);
+    // keep what didn't fit for the next publish
+    memmove(pfl->stage_buf, pfl->stage_buf + done, pfl->stage_len - done);
+    pfl->stage_len -= done;
+    return ret < 0 ? ret : 0;
+}
+
+static void pchar_stage_timeout(struct work_struct *work)
+{
+    struct pchar_file *pfl = container_of(to_delayed_work(work), struct pchar_file, stage_work);
+
+    mutex_lock(&pfl->stage_lock);
+    pchar_stage_publish(pfl, true);
+    // device full, try again later
+    if (pfl->stage_len != 0)
+        schedule_delayed_work(&pfl->stage_work, usecs_to_jiffies(pfl->stage_delay_us));
+    mutex_unlock(&pfl->stage_lock);
+}
+
+static ssize_t pchar_stage_write(struct pchar_file *pfl, const void *buf, size_t size, bool from_user, bool nonblock)
+{
+    ssize_t ret;
+
+    mutex_lock(&pfl->stage_lock);
+    if (pfl->stage_buf == NULL)
+    {
+        // coalescing switched off meanwhile
+        mutex_unlock(&pfl->stage_lock);
+        return pchar_enqueue(pfl->pdev, pfl->lane, buf, size, from_user, nonblock);
+    }
+    if (pfl->stage_len + size > pfl->stage_size)
+    {
+        ret = pchar_stage_publish(pfl, nonblock);
+        if (ret < 0 && pfl->stage_len + size > pfl->stage_size)
+            goto out;
+    }
+    // too big to stage, staging is empty here so order is kept
+    if (size > pfl->stage_size)
+    {
+        ret = pchar_enqueue(pfl->pdev, pfl->lane, buf, size, from_user, nonblock);
+        goto out;
+    }
+    if (!from_user)
+        memcpy(pfl->stage_buf + pfl->stage_len, buf, size);
+    else if (copy_from_user(pfl->stage_buf + pfl->stage_len, buf, size))
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+    pfl->stage_len += size;
+    ret = size;
+    if (pfl->stage_len == pfl->stage_size)
+        pchar_stage_publish(pfl, true);
+    // no-op when already pending, so timeout counts from the oldest staged byte
+    if (pfl->stage_len != 0)
+        schedule_delayed_work(&pfl->stage_work, usecs_to_jiffies(pfl->stage_delay_us));
+out:
+    mutex_unlock(&pfl->stage_lock);
+    return ret;
+}
+
+static int pchar_fsync(struct file *pfile, loff_t start, loff_t end, int datasync)
+{
+    struct pchar_file *pfl = (struct pchar_file*)pfile->private_data;
+    int ret;
+
+    mutex_lock(&pfl->stage_lock);
+    ret = pchar_stage_publish(pfl, pfile->f_flags & O_NONBLOCK);
+    mutex_unlock(&pfl->stage_lock);
+    return ret;
+}
+
+static ssize_t pchar_read(struct file *pfile, char *ubuf, size_t size, loff_t *poffset)
+{
+    ssize_t nbytes;
+    struct pchar_file *pfl = (struct pchar_file*)pfile->private_data;
+    printk(KERN_INFO "%s : pchar_read is called\n", THIS_MODULE->name);
+
+    nbytes = pchar_dequeue(pfl->pdev, ubuf, size, true, pfile->f_flags & O_NONBLOCK);
+    if(nbytes < 0){
+        printk(KERN_ERR"%s: pchar_read is failed to copy data from user to kernel space\n",THIS_MODULE->name);
+        return nbytes;
+    }
+    printk(KERN_INFO"%s : bytes read from user space %zd\n",THIS_MODULE->name,nbytes);
+    return nbytes;
+}
+
+static void pchar_bucket_set(struct pchar_bucket *b, u64 rate, u64 burst, u64 now)
+{
+    b->rate = rate;
+    b->burst = burst ? burst : rate;
+    b->tokens = b->burst;
+    b->last_ns = now;
+}
+
+static void pchar_bucket_fill(struct pchar_bucket *b, u64 now)
+{
+    u64 add;
+
+    if (b->rate == 0)
+        return;
+    add = mul_u64_u64_div_u64(now - b->last_ns, b->rate, NSEC_PER_SEC);
+    if (b->tokens + add >= b->burst)
+    {
+        b->tokens = b->burst;
+        b->last_ns = now;
+    }
+    else
+    {
+        // keep the part of a token already earned, slow buckets never fill otherwise
+        b->tokens += add;
+        b->last_ns += mul_u64_u64_div_u64(add, NSEC_PER_SEC, b->rate);
+    }
+}
+
+// ns till the bucket holds need tokens (at most a burst), 0 = holds them
+static u64 pchar_bucket_wait(struct pchar_bucket *b, u64 need, u64 now)
+{
+    u64 next;
+
+    need = max(min(need, b->burst), 1ULL);
+    if (b->rate == 0 || b->tokens >= need)
+        return 0;
+    next = b->last_ns + mul_u64_u64_div_u64(need - b->tokens, NSEC_PER_SEC, b->rate) + 1;
+    return next > now ? next - now : 1;
+}
+
+static void pchar_bucket_take(struct pchar_bucket *b, u64 n)
+{
+    if (b->rate != 0)
+        b->tokens -= min(b->tokens, n);
+}
+
+static void pchar_bucket_refund(struct pchar_bucket *b, u64 n)
+{
+    if (b->rate != 0)
+        b->tokens = min(b->tokens + n, b->burst);
+}
+
+static bool pchar_rate_on(struct pchar_rate *r)
+{
+    return READ_ONCE(r->bytes.rate) != 0 || READ_ONCE(r->ops.rate) != 0;
+}
+
+static void pchar_rate_set(struct pchar_device *pdev, struct pchar_rate *r, rate_limit_t *limit)
+{
+    u64 now = ktime_get_ns();
+
+    spin_lock(&pdev->rate_lock);
+    pchar_bucket_set(&r->bytes, limit->bytes_per_sec, limit->bytes_burst, now);
+    pchar_bucket_set(&r->ops, limit->ops_per_sec, limit->ops_burst, now);
+    r->policy = limit->policy;
+    spin_unlock(&pdev->rate_lock);
+}
+
+/*
+ * Wait till the device and the file token buckets allow one more write
+ * and return how many of size bytes it may store. A write waits for size
+ * bytes or a full burst, whichever is less. Writes past a limit sleep or
+ * get -EAGAIN by the policy of that limit; O_NONBLOCK writers never sleep.
+ * The returned bytes and one op are taken from the buckets in the same
+ * critical section, so concurrent writers can't spend the same tokens;
+ * *reserved tells the caller to give back what it did not write with
+ * pchar_rate_refund.
+ */
+static ssize_t pchar_rate_admit(struct pchar_file *pfl, size_t size, bool nonblock, bool *reserved)
+{
+    struct pchar_device *pdev = pfl->pdev;
+    struct pchar_rate *lim[2] = { &pdev->rate, &pfl->rate };
+    unsigned int hit = 0; // limits this write waited for
+    u64 now, wait, w, start = 0;
+    bool refuse;
+    ktime_t kt;
+    int i;
+
+    *reserved = false;
+    if (!pchar_rate_on(&pdev->rate) && !pchar_rate_on(&pfl->rate))
+        return size;
+
+    while (1)
+    {
+        spin_lock(&pdev->rate_lock);
+        now = ktime_get_ns();
+        wait = 0;
+        refuse = nonblock;
+        for (i = 0; i < 2; i++)
+        {
+            pchar_bucket_fill(&lim[i]->bytes, now);
+            pchar_bucket_fill(&lim[i]->ops, now);
+            w = max(pchar_bucket_wait(&lim[i]->bytes, size, now), pchar_bucket_wait(&lim[i]->ops, 1, now));
+            if (w == 0)
+                continue;
+            if (!(hit & (1 << i)))
+                lim[i]->count.throttled++;
+            hit |= 1 << i;
+            if (lim[i]->policy == PCHAR_RATE_EAGAIN)
+                refuse = true;
+            wait = max(wait, w);
+        }
+        if (wait == 0)
+        {
+            for (i = 0; i < 2; i++)
+            {
+                if (lim[i]->bytes.rate != 0)
+                    size = min_t(u64, size, lim[i]->bytes.tokens);
+                if (hit & (1 << i))
+                    lim[i]->count.throttle_ns += now - start;
+            }
+            for (i = 0; i < 2; i++)
+            {
+                pchar_bucket_take(&lim[i]->bytes, size);
+                pchar_bucket_take(&lim[i]->ops, 1);
+            }
+            *reserved = true;
+            spin_unlock(&pdev->rate_lock);
+            return size;
+        }
+        if (refuse)
+        {
+            for (i = 0; i < 2; i++)
+            {
+                if (hit & (1 << i))
+                    lim[i]->count.refused++;
+            }
+            spin_unlock(&pdev->rate_lock);
+            return -EAGAIN;
+        }
+        spin_unlock(&pdev->rate_lock);
+        if (start == 0)
+            start = now;
+        kt = ns_to_ktime(wait);
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout(&kt, HRTIMER_MODE_REL);
+        if (signal_pending(current))
+            return -ERESTARTSYS;
+    }
+}
+
+// give back the part of an admitted write that was not stored, all of it on error
+static void pchar_rate_refund(struct pchar_file *pfl, size_t admitted, ssize_t nbytes)
+{
+    struct pchar_device *pdev = pfl->pdev;
+    u64 unused = nbytes < 0 ? admitted : admitted - nbytes;
+
+    if (unused == 0 && nbytes >= 0)
+        return;
+    spin_lock(&pdev->rate_lock);
+    pchar_bucket_refund(&pdev->rate.bytes, unused);
+    pchar_bucket_refund(&pfl->rate.bytes, unused);
+    if (nbytes < 0)
+    {
+        pchar_bucket_refund(&pdev->rate.ops, 1);
+        pchar_bucket_refund(&pfl->rate.ops, 1);
+    }
+    spin_unlock(&pdev->rate_lock);
+    wake_up_interruptible(&pdev->wr_wq);
+}
+
+static enum hrtimer_restart pchar_rate_timeout(struct hrtimer *timer)
+{
+    struct pchar_device *pdev = container_of(timer, struct pchar_device, rate_timer);
+
+    wake_up_interruptible(&pdev->wr_wq);
+    return HRTIMER_NORESTART;
+}
+
+// false when a write would hit a limit now, rate_timer then wakes pollers once it wouldn't
+static bool pchar_rate_writable(struct pchar_file *pfl)
+{
+    struct pchar_device *pdev = pfl->pdev;
+    struct pchar_rate *lim[2] = { &pdev->rate, &pfl->rate };
+    u64 now, wait = 0;
+    ktime_t expires;
+    int i;
+
+    if (!pchar_rate_on(&pdev->rate) && !pchar_rate_on(&pfl->rate))
+        return true;
+    spin_lock(&pdev->rate_lock);
+    now = ktime_get_ns();
+    for (i = 0; i < 2; i++)
+    {
+        pchar_bucket_fill(&lim[i]->bytes, now);
+        pchar_bucket_fill(&lim[i]->ops, now);
+        wait = max3(wait, pchar_bucket_wait(&lim[i]->bytes, 1, now), pchar_bucket_wait(&lim[i]->ops, 1, now));
+    }
+    if (wait != 0)
+    {
+        expires = ns_to_ktime(now + wait);
+        if (!hrtimer_is_queued(&pdev->rate_timer) || ktime_before(expires, hrtimer_get_expires(&pdev->rate_timer)))
+            hrtimer_start(&pdev->rate_timer, expires, HRTIMER_MODE_ABS);
+    }
+    spin_unlock(&pdev->rate_lock);
+    return wait == 0;
+}
+
+// run the device filter on one write, true if it should be stored
+static bool pchar_filter_pass(struct pchar_device *pdev, struct sk_buff *skb)
+{
+    struct bpf_prog *prog;
+    unsigned int verdict = PCHAR_BPF_ACCEPT;
+    unsigned int every;
+
+    rcu_read_lock();
+    prog = rcu_dereference(pdev->filter);
+    if (prog != NULL)
+        verdict = bpf_prog_run_pin_on_cpu(prog, skb);
+    rcu_read_unlock();
+
+    switch (verdict)
+    {
+        case PCHAR_BPF_ACCEPT:
+            atomic64_inc(&pdev->bpf_accepted);
+            return true;
+        case PCHAR_BPF_SAMPLE:
+            every = READ_ONCE(pdev->sample_every);
+            if ((unsigned int)atomic_inc_return(&pdev->sample_seq) % every == 0)
+            {
+                atomic64_inc(&pdev->bpf_sampled);
+                return true;
+            }
+            atomic64_inc(&pdev->bpf_sample_skipped);
+            return false;
+        default:
+            // PCHAR_BPF_DROP and anything unknown
+            atomic64_inc(&pdev->bpf_dropped);
+            atomic64_add(skb->len, &pdev->bpf_dropped_bytes);
+            return false;
+    }
+}
+
+/*
+ * Filtered write: the user data is copied once into an skb, the program
+ * sees it as a socket filter packet, and only accepted data goes on to
+ * the lane or staging buffer. Dropped writes never take my_lock or wake
+ * readers and still report the full size to the writer.
+ */
+static ssize_t pchar_filter_write(struct pchar_file *pfl, const char *ubuf, size_t size, bool nonblock)
+{
+    struct sk_buff *skb;
+    ssize_t nbytes;
+
+    if (size == 0)
+        return 0;
+    size = min_t(size_t, size, PCHAR_BPF_MAX_WRITE);
+    skb = alloc_skb(size, GFP_KERNEL);
+    if (skb == NULL)
+        return -ENOMEM;
+    if (copy_from_user(skb_put(skb, size), ubuf, size))
+    {
+        kfree_skb(skb);
+        return -EFAULT;
+    }
+    if (!pchar_filter_pass(pfl->pdev, skb))
+    {
+        consume_skb(skb);
+        return size;
+    }
+    if (READ_ONCE(pfl->stage_buf) != NULL)
+        nbytes = pchar_stage_write(pfl, skb->data, size, false, nonblock);
+    else
+        nbytes = pchar_enqueue(pfl->pdev, pfl->lane, skb->data, size, false, nonblock);
+    consume_skb(skb);
+    return nbytes;
+}
+
+static ssize_t pchar_write(struct file *pfile, const char *ubuf, size_t size, loff_t *poffset)
+{
+    ssize_t nbytes;
+    struct pchar_file *pfl = (struct pchar_file*)pfile->private_data;
+    bool reserved;
+    printk(KERN_INFO "%s : pchar_write is called\n", THIS_MODULE->name);
+
+    // may cut the write to what the rate limits allow
+    nbytes = pchar_rate_admit(pfl, size, pfile->f_flags & O_NONBLOCK, &reserved);
+    if (nbytes < 0)
+        return nbytes;
+    size = nbytes;
+
+    if (rcu_access_pointer(pfl->pdev->filter) != NULL)
+        nbytes = pchar_filter_write(pfl, ubuf, size, pfile->f_flags & O_NONBLOCK);
+    else if (READ_ONCE(pfl->stage_buf) != NULL)
+        nbytes = pchar_stage_write(pfl, ubuf, size, true, pfile->f_flags & O_NONBLOCK);
+    else
+        nbytes = pchar_enqueue(pfl->pdev, pfl->lane, ubuf, size, true, pfile->f_flags & O_NONBLOCK);
+    if (reserved)
+        pchar_rate_refund(pfl, size, nbytes);
+    if(nbytes < 0){
+        printk(KERN_ERR"%s: pchar_write is failed to copy data from kernel to user space\n",THIS_MODULE->name);
+        return nbytes;
+    }
+    printk(KERN_INFO"%s : bytes write to user space %zd\n", THIS_MODULE->name,nbytes);
+    return nbytes;
+}
+
+// readable when any lane a reader may drain has data, writable when the
+// file's lane has room and the rate limits let a write through
+static __poll_t pchar_poll(struct file *pfile, poll_table *wait)
+{
+    struct pchar_file *pfl = (struct pchar_file*)pfile->private_data;
+    struct pchar_device *pdev = pfl->pdev;
+    __poll_t mask = 0;
+
+    poll_wait(pfile, &pdev->rd_wq, wait);
+    poll_wait(pfile, &pdev->wr_wq, wait);
+    if (!pchar_is_empty(pdev))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (!pchar_lane_full(pdev, pfl->lane) && pchar_rate_writable(pfl))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
+struct pchar_device *pchar_get_device(int minor)
+{
+    if (minor < 0 || minor >= my_devcnt)
+        return NULL;
+    return &my_devices[minor];
+}
+EXPORT_SYMBOL_GPL(pchar_get_device);
+
+int pchar_device_minor(struct pchar_device *pdev)
+{
+    return MINOR(pdev->my_devno);
+}
+EXPORT_SYMBOL_GPL(pchar_device_minor);
+
+ssize_t pchar_kernel_write(struct pchar_device *pdev, int lane, const void *buf, size_t size, bool nonblock)
+{
+    if (lane == PCHAR_LANE_BULK)
+        lane = pdev->nr_lanes - 1;
+    if (lane < 0 || lane >= pdev->nr_lanes)
+        return -EINVAL;
+    return pchar_enqueue(pdev, lane, buf, size, false, nonblock);
+}
+EXPORT_SYMBOL_GPL(pchar_kernel_write);
+
+ssize_t pchar_kernel_read(struct pchar_device *pdev, void *buf, size_t size, bool nonblock)
+{
+    return pchar_dequeue(pdev, buf, size, false, nonblock);
+}
+EXPORT_SYMBOL_GPL(pchar_kernel_read);
+
+int pchar_kernel_wait_write(struct pchar_device *pdev, int lane)
+{
+    if (lane == PCHAR_LANE_BULK)
+        lane = pdev->nr_lanes - 1;
+    if (lane < 0 || lane >= pdev->nr_lanes)
+        return -EINVAL;
+    // kthread_stop() wakes the thread, the condition then lets it out
+    return wait_event_interruptible(pdev->wr_wq, !pchar_lane_full(pdev, lane) ||
+        ((current->flags & PF_KTHREAD) && kthread_should_stop()));
+}
+EXPORT_SYMBOL_GPL(pchar_kernel_wait_write);
+
+int pchar_register_ready(struct pchar_device *pdev, pchar_ready_fn fn, void *ctx)
+{
+    struct pchar_ready *ready;
+
+    ready = kmalloc(sizeof(struct pchar_ready), GFP_KERNEL);
+    if (ready == NULL)
+        return -ENOMEM;
+    ready->fn = fn;
+    ready->ctx = ctx;
+
+    mutex_lock(&pdev->my_lock);
+    if (rcu_access_pointer(pdev->ready) != NULL)
+    {
+        mutex_unlock(&pdev->my_lock);
+        kfree(ready);
+        return -EBUSY;
+    }
+    rcu_assign_pointer(pdev->ready, ready);
+    mutex_unlock(&pdev->my_lock);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(pchar_register_ready);
+
+void pchar_unregister_ready(struct pchar_device *pdev)
+{
+    struct pchar_ready *ready;
+
+    mutex_lock(&pdev->my_lock);
+    ready = rcu_dereference_protected(pdev->ready, lockdep_is_held(&pdev->my_lock));
+    RCU_INIT_POINTER(pdev->ready, NULL);
+    mutex_unlock(&pdev->my_lock);
+    // callback may still be running on another cpu
+    synchronize_rcu();
+    kfree(ready);
+}
+EXPORT_SYMBOL_GPL(pchar_unregister_ready);
+
+// free a lane fifo, whichever memory backs it
+static void pchar_lane_free(struct pchar_device *pdev, int lane)
+{
+    if (pdev->dma_pages != NULL && lane == pdev->dma_lane)
+    {
+        __free_pages(pdev->dma_pages, pdev->dma_order);
+        pdev->dma_pages = NULL;
+        memset(&pdev->my_buf[lane], 0, sizeof(struct kfifo));
+        return;
+    }
+    kfifo_free(&pdev->my_buf[lane]);
+}
+
+// move fifo content into a new fifo of given size; data beyond new size is dropped
+static int pchar_resize_fifo(struct pchar_device *pdev, int lane, unsigned long size, gfp_t gfp)
+{
+    struct kfifo *fifo = &pdev->my_buf[lane];
+    struct kfifo new_fifo;
+    void *temp_buf;
+    unsigned int len, old_size = kfifo_size(fifo);
+    int ret;
+
+    ret = kfifo_alloc(&new_fifo, size, gfp);
+    if (ret != 0)
+        return ret;
+    len = min(kfifo_len(fifo), kfifo_size(&new_fifo));
+    temp_buf = kmalloc(len, gfp & ~__GFP_ACCOUNT);
+    if (temp_buf == NULL)
+    {
+        kfifo_free(&new_fifo);
+        return -ENOMEM;
+    }
+    len = kfifo_out(fifo, temp_buf, len);
+    kfifo_in(&new_fifo, temp_buf, len);
+    kfree(temp_buf);
+    pchar_lane_free(pdev, lane);
+    *fifo = new_fifo;
+    trace_pchar_resize(MINOR(pdev->my_devno), lane, old_size, kfifo_size(fifo), len);
+    return 0;
+}
+
+/*
+ * Elastic lane sizing. A lane doubles when writers keep finding it full
+ * or a write leaves it above high_pct, and halves once reads have seen it
+ * under low_pct for shrink_ms. 2 * low_pct < high_pct, so a lane just
+ * halved is never full enough to grow straight back. All with my_lock.
+ */
+static int pchar_elastic_resize(struct pchar_device *pdev, int lane, unsigned int size)
+{
+    unsigned int old_size = kfifo_size(&pdev->my_buf[lane]);
+    int ret;
+
+    // exported pages are pinned by the dma-buf
+    if (pchar_lane_exported(pdev, lane))
+        return -EBUSY;
+    ret = pchar_mem_reserve(pdev, pdev->mem_bytes - old_size + size);
+    if (ret == 0)
+        ret = pchar_resize_fifo(pdev, lane, size, GFP_KERNEL_ACCOUNT);
+    pchar_mem_settle(pdev);
+    if (ret != 0)
+        pdev->elastic_stats.failed++;
+    pdev->stalls[lane] = 0;
+    pdev->low_since[lane] = 0;
+    return ret;
+}
+
+static void pchar_elastic_grow(struct pchar_device *pdev, int lane, bool full)
+{
+    struct kfifo *fifo = &pdev->my_buf[lane];
+    unsigned int size = kfifo_size(fifo);
+
+    if (size >= pdev->elastic.max_size)
+        return;
+    if (!full && kfifo_len(fifo) * 100ULL <= (unsigned long long)pdev->elastic.high_pct * size)
+        return;
+    if (pchar_elastic_resize(pdev, lane, min(size * 2, pdev->elastic.max_size)) == 0)
+    {
+        pdev->elastic_stats.grows++;
+        wake_up_interruptible(&pdev->wr_wq);
+    }
+}
+
+// a writer found its lane full
+static void pchar_elastic_stall(struct pchar_device *pdev, int lane)
+{
+    mutex_lock(&pdev->my_lock);
+    if (pdev->elastic.max_size != 0 && kfifo_is_full(&pdev->my_buf[lane]))
+    {
+        pdev->elastic_stats.stalls++;
+        if (++pdev->stalls[lane] >= PCHAR_ELASTIC_STALLS)
+            pchar_elastic_grow(pdev, lane, true);
+    }
+    mutex_unlock(&pdev->my_lock);
+}
+
+// after a read, shrink lanes that stayed nearly empty long enough
+static void pchar_elastic_low(struct pchar_device *pdev)
+{
+    unsigned int size, len;
+    int lane;
+
+    for (lane = 0; lane < pdev->nr_lanes; lane++)
+    {
+        size = kfifo_size(&pdev->my_buf[lane]);
+        len = kfifo_len(&pdev->my_buf[lane]);
+        if (len * 100ULL >= (unsigned long long)pdev->elastic.low_pct * size)
+        {
+            pdev->low_since[lane] = 0;
+            continue;
+        }
+        // quiet lane, old stalls are not repeated anymore
+        pdev->stalls[lane] = 0;
+        if (size <= pdev->elastic.min_size)
+            continue;
+        if (pdev->low_since[lane] == 0)
+        {
+            pdev->low_since[lane] = jiffies | 1; // 0 means not low
+            continue;
+        }
+        if (time_before(jiffies, pdev->low_since[lane] + msecs_to_jiffies(pdev->elastic.shrink_ms)))
+            continue;
+        if (pchar_elastic_resize(pdev, lane, max(size / 2, pdev->elastic.min_size)) == 0)
+            pdev->elastic_stats.shrinks++;
+    }
+}
+
+/*
+ * Fifo memory accounting. mem_bytes follows the real kfifo sizes of a
+ * device and mem_used their sum over all devices. pchar_mem_reserve()
+ * checks a new device total against mem_max and mem_budget before any
+ * allocation; pchar_mem_settle() then fixes the numbers to what the
+ * lanes really hold. Both with my_lock held.
+ */
+static int pchar_mem_reserve(struct pchar_device *pdev, unsigned long bytes)
+{
+    unsigned long budget = READ_ONCE(mem_budget);
+    long delta = bytes - pdev->mem_bytes;
+
+    if (delta <= 0)
+        return 0;
+    if (pdev->mem_max != 0 && bytes > pdev->mem_max)
+        return -EDQUOT;
+    if (atomic_long_add_return(delta, &mem_used) > budget && budget != 0)
+    {
+        atomic_long_sub(delta, &mem_used);
+        return -EDQUOT;
+    }
+    pdev->mem_bytes = bytes;
+    return 0;
+}
+
+static void pchar_mem_settle(struct pchar_device *pdev)
+{
+    unsigned long bytes = 0;
+    int lane;
+
+    for (lane = 0; lane < pdev->nr_lanes; lane++)
+        bytes += kfifo_size(&pdev->my_buf[lane]);
+    atomic_long_add((long)bytes - (long)pdev->mem_bytes, &mem_used);
+    WRITE_ONCE(pdev->mem_bytes, bytes);
+}
+
+static unsigned long pchar_floor_size(void)
+{
+    return roundup_pow_of_two(max(READ_ONCE(mem_floor), 2U));
+}
+
+// smallest lane size the shrinker may leave, elastic lanes keep their min_size
+static unsigned long pchar_trim_size(struct pchar_device *pdev)
+{
+    unsigned long floor = pchar_floor_size();
+
+    if (READ_ONCE(pdev->elastic.max_size) != 0)
+        floor = max_t(unsigned long, floor, READ_ONCE(pdev->elastic.min_size));
+    return floor;
+}
+
+static bool pchar_is_idle(struct pchar_device *pdev)
+{
+    return time_after(jiffies, READ_ONCE(pdev->last_active) + msecs_to_jiffies(READ_ONCE(shrink_idle_ms)));
+}
+
+// pages the shrinker could give back by cutting idle devices to mem_floor
+static unsigned long pchar_shrink_count(struct shrinker *s, struct shrink_control *sc)
+{
+    unsigned long floor, pages = 0, bytes;
+    int i;
+
+    for (i = 0; i < my_devcnt; i++)
+    {
+        floor = pchar_trim_size(&my_devices[i]);
+        bytes = READ_ONCE(my_devices[i].mem_bytes);
+        if (pchar_is_idle(&my_devices[i]) && bytes > floor * my_devices[i].nr_lanes)
+            pages += DIV_ROUND_UP(bytes - floor * my_devices[i].nr_lanes, PAGE_SIZE);
+    }
+    return pages;
+}
+
+/*
+ * Trim lanes of idle devices to mem_floor, or to elastic.min_size when
+ * elastic sizing is on and that is larger. Lanes holding more than the
+ * floor are left alone so no data is lost. Devices busy with my_lock are
+ * skipped: a FIFO_RESIZE holding it may be the task in reclaim. The new
+ * small fifo is not charged to whoever happens to be reclaiming.
+ */
+static unsigned long pchar_shrink_scan(struct shrinker *s, struct shrink_control *sc)
+{
+    unsigned long floor, freed = 0, before;
+    struct pchar_device *pdev;
+    int i, lane;
+
+    for (i = 0; i < my_devcnt && freed < sc->nr_to_scan; i++)
+    {
+        pdev = &my_devices[i];
+        if (!pchar_is_idle(pdev) || !mutex_trylock(&pdev->my_lock))
+            continue;
+        if (pdev->dmabuf != NULL || pdev->lz_chunk != 0)
+        {
+            // exported pages are pinned by the dma-buf, compressed lanes keep their size
+            mutex_unlock(&pdev->my_lock);
+            continue;
+        }
+        before = pdev->mem_bytes;
+        floor = pchar_trim_size(pdev);
+        for (lane = 0; lane < pdev->nr_lanes; lane++)
+        {
+            if (kfifo_size(&pdev->my_buf[lane]) > floor && kfifo_len(&pdev->my_buf[lane]) <= floor)
+                pchar_resize_fifo(pdev, lane, floor, GFP_NOWAIT | __GFP_NOWARN);
+        }
+        pchar_mem_settle(pdev);
+        if (pdev->mem_bytes < before)
+        {
+            pdev->trimmed++;
+            freed += DIV_ROUND_UP(before - pdev->mem_bytes, PAGE_SIZE);
+        }
+        mutex_unlock(&pdev->my_lock);
+    }
+    return freed ? freed : SHRINK_STOP;
+}
+
+/*
+ * dma-buf export of one lane. The lane fifo is moved to physically
+ * contiguous pages (at least one page) so that it can be handed out
+ * whole. Importers see the raw ring; FIFO_DMABUF_BEGIN says where the
+ * readable bytes are and FIFO_DMABUF_END consumes them, so writers keep
+ * filling the ring while the consumer works on the window in place.
+ */
+static struct sg_table *pchar_dmabuf_map(struct dma_buf_attachment *attach, enum dma_data_direction dir)
+{
+    struct pchar_device *pdev = attach->dmabuf->priv;
+    struct sg_table *sgt;
+    int ret;
+
+    sgt = kzalloc(sizeof(struct sg_table), GFP_KERNEL);
+    if (sgt == NULL)
+        return ERR_PTR(-ENOMEM);
+    ret = sg_alloc_table(sgt, 1, GFP_KERNEL);
+    if (ret != 0)
+        goto sg_alloc_failed;
+    sg_set_page(sgt->sgl, pdev->dma_pages, attach->dmabuf->size, 0);
+    ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+    if (ret != 0)
+        goto dma_map_failed;
+    return sgt;
+
+dma_map_failed:
+    sg_free_table(sgt);
+sg_alloc_failed:
+    kfree(sgt);
+    return ERR_PTR(ret);
+}
+
+static void pchar_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt, enum dma_data_direction dir)
+{
+    dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static int pchar_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct pchar_device *pdev = dmabuf->priv;
+    unsigned long size = vma->vm_end - vma->vm_start;
+
+    if ((vma->vm_pgoff << PAGE_SHIFT) + size > dmabuf->size)
+        return -EINVAL;
+    return remap_pfn_range(vma, vma->vm_start, page_to_pfn(pdev->dma_pages) + vma->vm_pgoff, size, vma->vm_page_prot);
+}
+
+static int pchar_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+    struct pchar_device *pdev = dmabuf->priv;
+
+    iosys_map_set_vaddr(map, page_address(pdev->dma_pages));
+    return 0;
+}
+
+// last reference gone, the lane goes back to plain readers
+static void pchar_dmabuf_release(struct dma_buf *dmabuf)
+{
+    struct pchar_device *pdev = dmabuf->priv;
+
+    mutex_lock(&pdev->my_lock);
+    WRITE_ONCE(pdev->dmabuf, NULL);
+    pdev->dma_window = 0;
+    mutex_unlock(&pdev->my_lock);
+    wake_up_interruptible(&pdev->rd_wq);
+}
+
+static const struct dma_buf_ops pchar_dmabuf_ops = {
+    .map_dma_buf = pchar_dmabuf_map,
+    .unmap_dma_buf = pchar_dmabuf_unmap,
+    .mmap = pchar_dmabuf_mmap,
+    .vmap = pchar_dmabuf_vmap,
+    .release = pchar_dmabuf_release
+};
+
+// move a lane onto contiguous pages; caller holds my_lock and no export is live
+static int pchar_lane_to_pages(struct pchar_device *pdev, int lane)
+{
+    struct kfifo *fifo = &pdev->my_buf[lane];
+    unsigned long size = max_t(unsigned long, kfifo_size(fifo), PAGE_SIZE);
+    unsigned int order = get_order(size), len;
+    struct page *page;
+    int ret;
+
+    if (pdev->dma_pages != NULL)
+    {
+        if (lane == pdev->dma_lane)
+            return 0;
+        // the lane of the released export goes back to a plain kfifo of the same size
+        ret = pchar_resize_fifo(pdev, pdev->dma_lane, kfifo_size(&pdev->my_buf[pdev->dma_lane]), GFP_KERNEL_ACCOUNT);
+        if (ret != 0)
+            return ret;
+    }
+    ret = pchar_mem_reserve(pdev, pdev->mem_bytes - kfifo_size(fifo) + size);
+    if (ret != 0)
+        return ret;
+    page = alloc_pages(GFP_KERNEL_ACCOUNT | __GFP_ZERO, order);
+    if (page == NULL)
+    {
+        pchar_mem_settle(pdev);
+        return -ENOMEM;
+    }
+    // data lands at the start of the new ring
+    len = kfifo_out(fifo, page_address(page), size);
+    kfifo_free(fifo);
+    kfifo_init(fifo, page_address(page), size);
+    fifo->kfifo.in = len;
+    pdev->dma_pages = page;
+    pdev->dma_order = order;
+    pdev->dma_lane = lane;
+    pchar_mem_settle(pdev);
+    return 0;
+}
+
+static int pchar_dmabuf_begin(struct pchar_device *pdev, dmabuf_window_t *window, bool nonblock)
+{
+    struct kfifo *fifo;
+    int ret;
+
+    while (1)
+    {
+        mutex_lock(&pdev->my_lock);
+        if (pdev->dmabuf == NULL || pdev->dma_window != 0)
+        {
+            ret = pdev->dmabuf == NULL ? -EINVAL : -EBUSY;
+            mutex_unlock(&pdev->my_lock);
+            return ret;
+        }
+        fifo = &pdev->my_buf[pdev->dma_lane];
+        if (!kfifo_is_empty(fifo))
+            break;
+        mutex_unlock(&pdev->my_lock);
+        if (nonblock)
+            return -EAGAIN;
+        ret = wait_event_interruptible(pdev->rd_wq, !kfifo_is_empty(fifo) || READ_ONCE(pdev->dmabuf) == NULL); // interruptible sleep
+        if (ret != 0)
+            return -ERESTARTSYS;
+    }
+    // up to the end of the ring, wrapped bytes come with the next window
+    window->offset = fifo->kfifo.out & fifo->kfifo.mask;
+    window->len = min(kfifo_len(fifo), kfifo_size(fifo) - window->offset);
+    pdev->dma_window = window->len;
+    mutex_unlock(&pdev->my_lock);
+    return 0;
+}
+
+static int pchar_dmabuf_end(struct pchar_device *pdev, unsigned long len)
+{
+    struct kfifo *fifo;
+
+    mutex_lock(&pdev->my_lock);
+    if (pdev->dmabuf == NULL || len > pdev->dma_window)
+    {
+        mutex_unlock(&pdev->my_lock);
+        return -EINVAL;
+    }
+    fifo = &pdev->my_buf[pdev->dma_lane];
+    fifo->kfifo.out += len;
+    pdev->dma_window = 0;
+    if (len > 0)
+    {
+        pdev->stats.reads++;
+        pdev->stats.bytes_out += len;
+        pchar_fill_check(pdev);
+    }
+    pdev->last_active = jiffies;
+    mutex_unlock(&pdev->my_lock);
+    if (len > 0)
+        wake_up_interruptible(&pdev->wr_wq);
+    return 0;
+}
+
+/*
+ * Switch lz4 compression on with the given chunk size, or off with 0.
+ * Only an empty device can change mode, records of one chunk size are
+ * never read back with another. Lane 0 must hold a whole stored chunk.
+ */
+static int pchar_lz_set(struct pchar_device *pdev, unsigned long chunk)
+{
+    char *open = NULL, *dec = NULL, *cbuf = NULL;
+    void *wrkmem = NULL;
+    int ret = 0;
+
+    if (chunk != 0)
+    {
+        if (chunk < PCHAR_LZ_CHUNK_MIN || chunk > PCHAR_LZ_CHUNK_MAX)
+            return -EINVAL;
+        // records would have to be kept per lane
+        if (pdev->nr_lanes != 1)
+            return -EOPNOTSUPP;
+        open = kmalloc(chunk, GFP_KERNEL_ACCOUNT);
+        dec = kmalloc(chunk, GFP_KERNEL_ACCOUNT);
+        cbuf = kmalloc(LZ4_COMPRESSBOUND(chunk), GFP_KERNEL_ACCOUNT);
+        wrkmem = kmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL_ACCOUNT);
+        if (open == NULL || dec == NULL || cbuf == NULL || wrkmem == NULL)
+        {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    mutex_lock(&pdev->my_lock);
+    if (!pchar_is_empty(pdev) || pdev->dmabuf != NULL || pdev->elastic.max_size != 0)
+        ret = -EBUSY;
+    else if (chunk != 0 && kfifo_size(&pdev->my_buf[0]) < sizeof(struct pchar_lz_hdr) + chunk)
+        ret = -ENOSPC;
+    if (ret == 0)
+    {
+        swap(pdev->lz_open, open);
+        swap(pdev->lz_dec, dec);
+        swap(pdev->lz_cbuf, cbuf);
+        swap(pdev->lz_wrkmem, wrkmem);
+        pdev->lz_open_off = pdev->lz_open_len = 0;
+        pdev->lz_dec_off = pdev->lz_dec_len = 0;
+        pdev->lz_fifo_logical = 0;
+        memset(&pdev->lz_stats, 0, sizeof(lz_stats_t));
+        WRITE_ONCE(pdev->lz_chunk, chunk);
+    }
+    mutex_unlock(&pdev->my_lock);
+    // writers sleep on a different condition now
+    wake_up_interruptible(&pdev->wr_wq);
+out:
+    // the old buffers, or the new ones if they were not needed
+    kfree(open);
+    kfree(dec);
+    kfree(cbuf);
+    kfree(wrkmem);
+    return ret;
+}
+
+// install or remove the FIFO_FILL_NOTIFY eventfds of a device
+static int pchar_fill_notify(struct pchar_device *pdev, fill_notify_t *fill_notify)
+{
+    struct eventfd_ctx *rise = NULL, *fall = NULL;
+    u64 len = 0, size = 0;
+    int lane;
+
+    if ((fill_notify->rise_fd >= 0 || fill_notify->fall_fd >= 0) &&
+        (fill_notify->rise_pct > 100 || fill_notify->fall_pct >= fill_notify->rise_pct))
+        return -EINVAL;
+    if (fill_notify->rise_fd >= 0)
+    {
+        rise = eventfd_ctx_fdget(fill_notify->rise_fd);
+        if (IS_ERR(rise))
+            return PTR_ERR(rise);
+    }
+    if (fill_notify->fall_fd >= 0)
+    {
+        fall = eventfd_ctx_fdget(fill_notify->fall_fd);
+        if (IS_ERR(fall))
+        {
+            if (rise != NULL)
+                eventfd_ctx_put(rise);
+            return PTR_ERR(fall);
+        }
+    }
+
+    mutex_lock(&pdev->my_lock);
+    swap(pdev->rise_ev, rise);
+    swap(pdev->fall_ev, fall);
+    pdev->rise_pct = fill_notify->rise_pct;
+    pdev->fall_pct = fill_notify->fall_pct;
+    // start on the side of the threshold the device is on now
+    for (lane = 0; lane < pdev->nr_lanes; lane++)
+    {
+        len += kfifo_len(&pdev->my_buf[lane]);
+        size += kfifo_size(&pdev->my_buf[lane]);
+    }
+    pdev->fill_high = len * 100 >= pdev->rise_pct * size;
+    mutex_unlock(&pdev->my_lock);
+    // the ones replaced
+    if (rise != NULL)
+        eventfd_ctx_put(rise);
+    if (fall != NULL)
+        eventfd_ctx_put(fall);
+    printk(KERN_INFO "%s : fill notify %u%%/%u%%\n", THIS_MODULE->name, fill_notify->rise_pct, fill_notify->fall_pct);
+    return 0;
+}
+
+static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param){
+    info_t info;
+    lane_info_t lane_info;
+    lane_sched_t lane_sched;
+    stats_t stats;
+    coalesce_t coalesce;
+    bpf_attach_t bpf_attach;
+    bpf_stats_t bpf_stats;
+    dmabuf_export_t dmabuf_export;
+    dmabuf_window_t dmabuf_window;
+    elastic_t elastic;
+    elastic_stats_t elastic_stats;
+    info_ex_t info_ex;
+    rate_limit_t rate_limit;
+    rate_stats_t rate_stats;
+    fill_notify_t fill_notify;
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct dma_buf *dmabuf;
+    struct bpf_prog *prog = NULL;
+    char *stage_buf = NULL;
+    int ret = 0, lane;
+    struct pchar_file *pfl = (struct pchar_file *)pfile->private_data;
+    struct pchar_device *pdev = pfl->pdev;
+    switch(cmd){
+        case FIFO_CLEAR:
+            printk(KERN_INFO"%s : pchar_ioctl() fifo clear\n", THIS_MODULE->name);
+            mutex_lock(&pdev->my_lock);
+            for (lane = 0; lane < pdev->nr_lanes; lane++)
+            {
+                kfifo_reset(&pdev->my_buf[lane]);
+                pdev->deficit[lane] = 0;
+            }
+            pdev->dma_window = 0;
+            pdev->lz_open_off = pdev->lz_open_len = 0;
+            pdev->lz_dec_off = pdev->lz_dec_len = 0;
+            pdev->lz_fifo_logical = 0;
+            pchar_fill_check(pdev);
+            mutex_unlock(&pdev->my_lock);
+            wake_up_interruptible(&pdev->wr_wq);
+            break;
+
+        case FIFO_INFO:
+            printk(KERN_INFO"%s : pchar_ioctl() fifo info\n", THIS_MODULE->name);
+            // totals across all lanes
+            memset(&info, 0, sizeof(info_t));
+            mutex_lock(&pdev->my_lock);
+            for (lane = 0; lane < pdev->nr_lanes; lane++)
+            {
+                info.size += kfifo_size(&pdev->my_buf[lane]);
+                info.avail += kfifo_avail(&pdev->my_buf[lane]);
+                info.len += kfifo_len(&pdev->my_buf[lane]);
+            }
+            mutex_unlock(&pdev->my_lock);
+            if (copy_to_user((void*)param,&info,sizeof(info_t)))
+                return -EFAULT;
+            break;
+
+        case FIFO_RESIZE:
+            printk(KERN_INFO"%s : pchar_ioctl() fifo resize\n", THIS_MODULE->name);
+            if (param < 2 || param > PCHAR_FIFO_MAX)
+                return -EINVAL;
+            // every lane is resized to the new size, charged to the caller's memcg
+            mutex_lock(&pdev->my_lock);
+            ret = pdev->dmabuf != NULL ? -EBUSY : pchar_mem_reserve(pdev, roundup_pow_of_two(param) * pdev->nr_lanes);
+            // cutting a compressed lane would cut a record
+            if (ret == 0 && pdev->lz_chunk != 0 && (roundup_pow_of_two(param) < kfifo_len(&pdev->my_buf[0]) ||
+                roundup_pow_of_two(param) < sizeof(struct pchar_lz_hdr) + pdev->lz_chunk))
+                ret = -EINVAL;
+            for (lane = 0; ret == 0 && lane < pdev->nr_lanes; lane++)
+            {
+                ret = pchar_resize_fifo(pdev, lane, param, GFP_KERNEL_ACCOUNT);
+                if (ret != 0)
+                    printk(KERN_ERR "%s : pchar_ioctl() resize failed for lane %d\n", THIS_MODULE->name, lane);
+            }
+            pchar_mem_settle(pdev);
+            pchar_fill_check(pdev);
+            mutex_unlock(&pdev->my_lock);
+            // lanes resized before a failure may have room now too
+            wake_up_interruptible(&pdev->wr_wq);
+            if (ret != 0)
+                return ret;
+            printk(KERN_INFO"%s : pchar_ioctl() fifo resize to %u done\n", THIS_MODULE->name, kfifo_size(&pdev->my_buf[0]));
+            break;
+
+        case FIFO_SET_LANE:
+            if (param >= pdev->nr_lanes)
+                return -EINVAL;
+            pfl->lane = param;
+            printk(KERN_INFO"%s : pchar_ioctl() writer lane set to %d\n", THIS_MODULE->name, pfl->lane);
+            break;
+
+        case FIFO_LANE_INFO:
+            memset(&lane_info, 0, sizeof(lane_info_t));
+            mutex_lock(&pdev->my_lock);
+            lane_info.nr_lanes = pdev->nr_lanes;
+            lane_info.sched = pdev->sched;
+            for (lane = 0; lane < pdev->nr_lanes; lane++)
+            {
+                lane_info.size[lane] = kfifo_size(&pdev->my_buf[lane]);
+                lane_info.len[lane] = kfifo_len(&pdev->my_buf[lane]);
+                lane_info.weight[lane] = pdev->weight[lane];
+            }
+            mutex_unlock(&pdev->my_lock);
+            if (copy_to_user((void*)param,&lane_info,sizeof(lane_info_t)))
+                return -EFAULT;
+            break;
+
+        case FIFO_SET_SCHED:
+            if (copy_from_user(&lane_sched,(void*)param,sizeof(lane_sched_t)))
+                return -EFAULT;
+            if (lane_sched.sched != PCHAR_SCHED_STRICT && lane_sched.sched != PCHAR_SCHED_WRR)
+                return -EINVAL;
+            for (lane = 0; lane < pdev->nr_lanes; lane++)
+            {
+                if (lane_sched.weight[lane] <= 0)
+                    return -EINVAL;
+            }
+            mutex_lock(&pdev->my_lock);
+            pdev->sched = lane_sched.sched;
+            for (lane = 0; lane < pdev->nr_lanes; lane++)
+            {
+                pdev->weight[lane] = lane_sched.weight[lane];
+                pdev->deficit[lane] = 0;
+            }
+            pdev->rr_lane = 0;
+            mutex_unlock(&pdev->my_lock);
+            printk(KERN_INFO"%s : pchar_ioctl() lane sched set to %d\n", THIS_MODULE->name, pdev->sched);
+            break;
+
+        case FIFO_STATS:
+            mutex_lock(&pdev->my_lock);
+            stats = pdev->stats;
+            mutex_unlock(&pdev->my_lock);
+            if (copy_to_user((void*)param,&stats,sizeof(stats_t)))
+                return -EFAULT;
+            break;
+
+        case FIFO_COALESCE:
+            if (copy_from_user(&coalesce,(void*)param,sizeof(coalesce_t)))
+                return -EFAULT;
+            if (coalesce.size > PCHAR_STAGE_MAX)
+                return -EINVAL;
+            if (coalesce.size != 0)
+            {
+                stage_buf = kmalloc(coalesce.size, GFP_KERNEL_ACCOUNT);
+                if (stage_buf == NULL)
+                    return -ENOMEM;
+            }
+            mutex_lock(&pfl->stage_lock);
+            // old staged data goes out before the buffer changes
+            ret = pchar_stage_publish(pfl, pfile->f_flags & O_NONBLOCK);
+            if (ret != 0)
+            {
+                mutex_unlock(&pfl->stage_lock);
+                kfree(stage_buf);
+                return ret;
+            }
+            swap(pfl->stage_buf, stage_buf);
+            pfl->stage_size = coalesce.size;
+            pfl->stage_delay_us = coalesce.delay_us ? coalesce.delay_us : PCHAR_STAGE_DELAY_US;
+            mutex_unlock(&pfl->stage_lock);
+            kfree(stage_buf);
+            printk(KERN_INFO"%s : pchar_ioctl() coalescing size=%u delay=%uus\n", THIS_MODULE->name, coalesce.size, pfl->stage_delay_us);
+            break;
+
+        case FIFO_FLUSH:
+            return pchar_fsync(pfile, 0, LLONG_MAX, 0);
+
+        case FIFO_SET_BPF:
+            if (copy_from_user(&bpf_attach,(void*)param,sizeof(bpf_attach_t)))
+                return -EFAULT;
+            if (bpf_attach.fd >= 0)
+            {
+                prog = bpf_prog_get_type(bpf_attach.fd, BPF_PROG_TYPE_SOCKET_FILTER);
+                if (IS_ERR(prog))
+                    return PTR_ERR(prog);
+            }
+            mutex_lock(&pdev->my_lock);
+            WRITE_ONCE(pdev->sample_every, bpf_attach.sample_every ? bpf_attach.sample_every : 1);
+            prog = rcu_replace_pointer(pdev->filter, prog, lockdep_is_held(&pdev->my_lock));
+            mutex_unlock(&pdev->my_lock);
+            // writers may still be running the old program
+            if (prog != NULL)
+            {
+                synchronize_rcu();
+                bpf_prog_put(prog);
+            }
+            printk(KERN_INFO"%s : pchar_ioctl() write filter %s\n", THIS_MODULE->name, bpf_attach.fd >= 0 ? "attached" : "detached");
+            break;
+
+        case FIFO_BPF_STATS:
+            bpf_stats.accepted = atomic64_read(&pdev->bpf_accepted);
+            bpf_stats.dropped = atomic64_read(&pdev->bpf_dropped);
+            bpf_stats.sampled = atomic64_read(&pdev->bpf_sampled);
+            bpf_stats.sample_skipped = atomic64_read(&pdev->bpf_sample_skipped);
+            bpf_stats.dropped_bytes = atomic64_read(&pdev->bpf_dropped_bytes);
+            if (copy_to_user((void*)param,&bpf_stats,sizeof(bpf_stats_t)))
+                return -EFAULT;
+            break;
+
+        case FIFO_EXPORT_DMABUF:
+            if (copy_from_user(&dmabuf_export,(void*)param,sizeof(dmabuf_export_t)))
+                return -EFAULT;
+            if (dmabuf_export.lane < 0 || dmabuf_export.lane >= pdev->nr_lanes)
+                return -EINVAL;
+            mutex_lock(&pdev->my_lock);
+            // one export per device, share it by passing the fd on
+            ret = pdev->dmabuf != NULL || pdev->lz_chunk != 0 ? -EBUSY : pchar_lane_to_pages(pdev, dmabuf_export.lane);
+            if (ret != 0)
+            {
+                mutex_unlock(&pdev->my_lock);
+                return ret;
+            }
+            exp_info.ops = &pchar_dmabuf_ops;
+            exp_info.size = kfifo_size(&pdev->my_buf[dmabuf_export.lane]);
+            exp_info.flags = O_RDWR;
+            exp_info.priv = pdev;
+            dmabuf = dma_buf_export(&exp_info);
+            if (IS_ERR(dmabuf))
+            {
+                mutex_unlock(&pdev->my_lock);
+                return PTR_ERR(dmabuf);
+            }
+            pdev->dma_window = 0;
+            WRITE_ONCE(pdev->dmabuf, dmabuf);
+            mutex_unlock(&pdev->my_lock);
+            dmabuf_export.size = exp_info.size;
+            dmabuf_export.fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+            if (dmabuf_export.fd < 0)
+            {
+                dma_buf_put(dmabuf);
+                return dmabuf_export.fd;
+            }
+            if (copy_to_user((void*)param,&dmabuf_export,sizeof(dmabuf_export_t)))
+                return -EFAULT;
+            printk(KERN_INFO"%s : pchar_ioctl() lane %d exported, %u bytes\n", THIS_MODULE->name, dmabuf_export.lane, dmabuf_export.size);
+            break;
+
+        case FIFO_DMABUF_BEGIN:
+            ret = pchar_dmabuf_begin(pdev, &dmabuf_window, pfile->f_flags & O_NONBLOCK);
+            if (ret != 0)
+                return ret;
+            if (copy_to_user((void*)param,&dmabuf_window,sizeof(dmabuf_window_t)))
+                return -EFAULT;
+            break;
+
+        case FIFO_DMABUF_END:
+            return pchar_dmabuf_end(pdev, param);
+
+        case FIFO_SET_ELASTIC:
+            if (copy_from_user(&elastic,(void*)param,sizeof(elastic_t)))
+                return -EFAULT;
+            if (elastic.max_size != 0)
+            {
+                if (elastic.min_size < 2 || elastic.min_size > elastic.max_size || elastic.max_size > PCHAR_FIFO_MAX)
+                    return -EINVAL;
+                if (elastic.high_pct > 100 || elastic.low_pct * 2 >= elastic.high_pct)
+                    return -EINVAL;
+                elastic.min_size = roundup_pow_of_two(elastic.min_size);
+                elastic.max_size = roundup_pow_of_two(elastic.max_size);
+                if (elastic.shrink_ms == 0)
+                    elastic.shrink_ms = PCHAR_ELASTIC_SHRINK_MS;
+            }
+            mutex_lock(&pdev->my_lock);
+            // compressed lanes keep the size FIFO_SET_LZ checked
+            if (pdev->lz_chunk != 0 && elastic.max_size != 0)
+            {
+                mutex_unlock(&pdev->my_lock);
+                return -EBUSY;
+            }
+            pdev->elastic = elastic;
+            for (lane = 0; lane < pdev->nr_lanes; lane++)
+            {
+                pdev->stalls[lane] = 0;
+                pdev->low_since[lane] = 0;
+                if (elastic.max_size == 0)
+                    continue;
+                // bring lanes into range now, never dropping data
+                if (kfifo_size(&pdev->my_buf[lane]) < elastic.min_size)
+                    pchar_elastic_resize(pdev, lane, elastic.min_size);
+                else if (kfifo_size(&pdev->my_buf[lane]) > elastic.max_size && kfifo_len(&pdev->my_buf[lane]) <= elastic.max_size)
+                    pchar_elastic_resize(pdev, lane, elastic.max_size);
+            }
+            mutex_unlock(&pdev->my_lock);
+            wake_up_interruptible(&pdev->wr_wq);
+            printk(KERN_INFO"%s : pchar_ioctl() elastic sizing %u..%u\n", THIS_MODULE->name, elastic.min_size, elastic.max_size);
+            break;
+
+        case FIFO_ELASTIC_STATS:
+            mutex_lock(&pdev->my_lock);
+            elastic_stats = pdev->elastic_stats;
+            mutex_unlock(&pdev->my_lock);
+            if (copy_to_user((void*)param,&elastic_stats,sizeof(elastic_stats_t)))
+                return -EFAULT;
+            break;
+
+        case FIFO_SET_LZ:
+            ret = pchar_lz_set(pdev, param);
+            if (ret != 0)
+                return ret;
+            printk(KERN_INFO"%s : pchar_ioctl() lz4 chunk set to %lu\n", THIS_MODULE->name, param);
+            break;
+
+        case FIFO_INFO_EX:
+            memset(&info_ex, 0, sizeof(info_ex_t));
+            mutex_lock(&pdev->my_lock);
+            for (lane = 0; lane < pdev->nr_lanes; lane++)
+            {
+                info_ex.size += kfifo_size(&pdev->my_buf[lane]);
+                info_ex.avail += kfifo_avail(&pdev->my_buf[lane]);
+                info_ex.len += kfifo_len(&pdev->my_buf[lane]);
+            }
+            info_ex.lz_chunk = pdev->lz_chunk;
+            info_ex.logical_len = pdev->lz_chunk != 0 ? pchar_lz_logical(pdev) : info_ex.len;
+            info_ex.lz = pdev->lz_stats;
+            mutex_unlock(&pdev->my_lock);
+            if (copy_to_user((void*)param,&info_ex,sizeof(info_ex_t)))
+                return -EFAULT;
+            break;
+
+        case FIFO_SET_RATE:
+            if (copy_from_user(&rate_limit,(void*)param,sizeof(rate_limit_t)))
+                return -EFAULT;
+            if (rate_limit.policy != PCHAR_RATE_SLEEP && rate_limit.policy != PCHAR_RATE_EAGAIN)
+                return -EINVAL;
+            pchar_rate_set(pdev, rate_limit.per_file ? &pfl->rate : &pdev->rate, &rate_limit);
+            printk(KERN_INFO"%s : pchar_ioctl() %s rate limit %llu B/s, %u ops/s\n", THIS_MODULE->name,
+                rate_limit.per_file ? "file" : "device", rate_limit.bytes_per_sec, rate_limit.ops_per_sec);
+            break;
+
+        case FIFO_RATE_STATS:
+            spin_lock(&pdev->rate_lock);
+            rate_stats.dev = pdev->rate.count;
+            rate_stats.file = pfl->rate.count;
+            spin_unlock(&pdev->rate_lock);
+            if (copy_to_user((void*)param,&rate_stats,sizeof(rate_stats_t)))
+                return -EFAULT;
+            break;
+
+        case FIFO_FILL_NOTIFY:
+            if (copy_from_user(&fill_notify,(void*)param,sizeof(fill_notify_t)))
+                return -EFAULT;
+            return pchar_fill_notify(pdev, &fill_notify);
+
+        default:
+            printk(KERN_INFO"%s : pchar_ioctl() unspported cmd\n", THIS_MODULE->name);
+            return -EINVAL;
+    }
+    return 0;
+}
+
+// my_char_all readers sleep on all_wq, kicked from every device rd_wq
+static int pchar_all_wake(wait_queue_entry_t *wait, unsigned int mode, int sync, void *key)
+{
+    wake_up_interruptible(&all_wq);
+    return 0;
+}
+
+static bool pchar_all_ready(void)
+{
+    int i;
+    for (i = 0; i < my_devcnt; i++)
+    {
+        if (!pchar_is_empty(&my_devices[i]))
+            return true;
+    }
+    return false;
+}
+
+static int pchar_all_open(struct inode *pinode, struct file *pfile)
+{
+    int i;
+    printk(KERN_INFO "%s : pchar_all_open is called\n",THIS_MODULE->name);
+    mutex_lock(&all_lock);
+    if (all_users++ == 0)
+    {
+        for (i = 0; i < my_devcnt; i++)
+            add_wait_queue(&my_devices[i].rd_wq, &my_devices[i].all_wait);
+    }
+    mutex_unlock(&all_lock);
+    return 0;
+}
+
+static int pchar_all_close(struct inode *pinode, struct file *pfile)
+{
+    int i;
+    printk(KERN_INFO "%s : pchar_all_close is called\n",THIS_MODULE->name);
+    mutex_lock(&all_lock);
+    if (--all_users == 0)
+    {
+        for (i = 0; i < my_devcnt; i++)
+            remove_wait_queue(&my_devices[i].rd_wq, &my_devices[i].all_wait);
+    }
+    mutex_unlock(&all_lock);
+    return 0;
+}
+
+// returns records of rec_hdr_t followed by len data bytes, devices served round robin
+static ssize_t pchar_all_read(struct file *pfile, char *ubuf, size_t size, loff_t *poffset)
+{
+    struct pchar_device *pdev;
+    rec_hdr_t hdr;
+    size_t off = 0;
+    ssize_t nbytes, err = 0;
+    unsigned int quota;
+    int idle, ret;
+
+    if (size <= sizeof(rec_hdr_t))
+        return -EINVAL;
+
+    while (off == 0 && err == 0)
+    {
+        if ((pfile->f_flags & O_NONBLOCK) && !pchar_all_ready())
+            return -EAGAIN;
+        ret = wait_event_interruptible(all_wq, pchar_all_ready()); // interruptible sleep
+        if (ret != 0)
+            return -ERESTARTSYS;
+
+        mutex_lock(&all_lock);
+        for (idle = 0; idle < my_devcnt && size - off > sizeof(rec_hdr_t); )
+        {
+            pdev = &my_devices[all_rr];
+            all_rr = (all_rr + 1) % my_devcnt;
+            quota = min_t(size_t, pdev->all_weight * PCHAR_ALL_QUANTUM, size - off - sizeof(rec_hdr_t));
+            quota = min_t(unsigned int, quota, PCHAR_ALL_MAX_REC);
+
+            // device keeps its own lane scheduling inside the record
+            mutex_lock(&pdev->my_lock);
+            nbytes = pchar_read_locked(pdev, ubuf + off + sizeof(rec_hdr_t), quota, true);
+            if (nbytes > 0)
+            {
+                pdev->stats.reads++;
+                pdev->stats.bytes_out += nbytes;
+                pchar_fill_check(pdev);
+                // only devices that gave data, the round robin visits idle ones too
+                pdev->last_active = jiffies;
+            }
+            if (pdev->elastic.max_size != 0)
+                pchar_elastic_low(pdev);
+            mutex_unlock(&pdev->my_lock);
+            if (nbytes < 0)
+            {
+                err = nbytes;
+                break;
+            }
+            if (nbytes == 0)
+            {
+                idle++;
+                continue;
+            }
+            idle = 0;
+            hdr.minor = pchar_device_minor(pdev);
+            hdr.len = nbytes;
+            if (copy_to_user(ubuf + off, &hdr, sizeof(rec_hdr_t)))
+            {
+                err = -EFAULT;
+                break;
+            }
+            off += sizeof(rec_hdr_t) + nbytes;
+            wake_up_interruptible(&pdev->wr_wq);
+        }
+        mutex_unlock(&all_lock);
+    }
+    if (off == 0)
+        return err;
+    return off;
+}
+
+static __poll_t pchar_all_poll(struct file *pfile, poll_table *wait)
+{
+    poll_wait(pfile, &all_wq, wait);
+    return pchar_all_ready() ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static long pchar_all_ioctl(struct file *pfile, unsigned int cmd, unsigned long param)
+{
+    all_weight_t all_weight;
+    switch(cmd){
+        case FIFO_ALL_WEIGHT:
+            if (copy_from_user(&all_weight,(void*)param,sizeof(all_weight_t)))
+                return -EFAULT;
+            if (all_weight.minor < 0 || all_weight.minor >= my_devcnt || all_weight.weight <= 0 || all_weight.weight > PCHAR_ALL_MAX_WEIGHT)
+                return -EINVAL;
+            mutex_lock(&all_lock);
+            my_devices[all_weight.minor].all_weight = all_weight.weight;
+            mutex_unlock(&all_lock);
+            printk(KERN_INFO"%s : pchar_all_ioctl() my_char%d weight set to %d\n", THIS_MODULE->name, all_weight.minor, all_weight.weight);
+            break;
+        default:
+            printk(KERN_INFO"%s : pchar_all_ioctl() unspported cmd\n", THIS_MODULE->name);
             return -EINVAL;
     }
     return 0;
@@ -4,8 +4,36 @@
 #include <sys/ioctl.h>
 #include <string.h>
 #include<stdlib.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <linux/bpf.h>
 #include "pchar_ioctl.h"
 
+// socket filter: writes starting with drop_char are dropped, the rest sampled or accepted
+static int load_filter(int drop_char, int verdict)
+{
+    struct bpf_insn prog[] = {
+        { .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1 },
+        { .code = BPF_LD | BPF_ABS | BPF_B, .imm = 0 },
+        { .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_0, .off = 2, .imm = drop_char },
+        { .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = verdict },
+        { .code = BPF_JMP | BPF_EXIT },
+        { .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = PCHAR_BPF_DROP },
+        { .code = BPF_JMP | BPF_EXIT },
+    };
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns = (unsigned long)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (unsigned long)"GPL";
+    return syscall(SYS_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+}
+
 int main(int argc, char *argv[])
 {
     int fd, ret;
@@ -52,6 +80,242 @@ int main(int argc, char *argv[])
             perror("ioctl() failed");
 
     }
+    else if (strcmp(argv[1], "lanes") == 0)
+    {
+        // per lane fill
+        lane_info_t lane_info;
+        int i;
+        ret = ioctl(fd, FIFO_LANE_INFO, &lane_info);
+        if (ret != 0)
+            perror("ioctl() failed");
+        else
+        {
+            printf("lanes=%d, sched=%s\n", lane_info.nr_lanes, lane_info.sched == PCHAR_SCHED_WRR ? "wrr" : "strict");
+            for (i = 0; i < lane_info.nr_lanes; i++)
+                printf("lane %d: size=%d, filled=%d, weight=%d\n", i, lane_info.size[i], lane_info.len[i], lane_info.weight[i]);
+        }
+    }
+    else if (strcmp(argv[1], "wrr") == 0 || strcmp(argv[1], "strict") == 0)
+    {
+        // lane read scheduling, weights given as remaining args
+        lane_sched_t lane_sched;
+        int i;
+        lane_sched.sched = strcmp(argv[1], "wrr") == 0 ? PCHAR_SCHED_WRR : PCHAR_SCHED_STRICT;
+        for (i = 0; i < PCHAR_MAX_LANES; i++)
+            lane_sched.weight[i] = (i + 2 < argc) ? atoi(argv[i + 2]) : 1;
+        ret = ioctl(fd, FIFO_SET_SCHED, &lane_sched);
+        if (ret != 0)
+            perror("ioctl() failed");
+    }
+    else if (strcmp(argv[1], "stats") == 0)
+    {
+        stats_t stats;
+        ret = ioctl(fd, FIFO_STATS, &stats);
+        if (ret != 0)
+            perror("ioctl() failed");
+        else
+            printf("writes=%llu, reads=%llu, bytes_in=%llu, bytes_out=%llu, batches=%llu, stage_dropped=%llu\n",
+                stats.writes, stats.reads, stats.bytes_in, stats.bytes_out, stats.batches, stats.stage_dropped);
+    }
+    else if (strcmp(argv[1], "bpf") == 0)
+    {
+        // bpf <drop char> [sample_every]  -> drop writes starting with drop char
+        // bpf off                        -> detach
+        bpf_attach_t attach;
+        attach.fd = -1;
+        attach.sample_every = (argc > 3) ? atoi(argv[3]) : 0;
+        if (argc > 2 && strcmp(argv[2], "off") != 0)
+        {
+            attach.fd = load_filter(argv[2][0], attach.sample_every ? PCHAR_BPF_SAMPLE : PCHAR_BPF_ACCEPT);
+            if (attach.fd < 0)
+                perror("BPF_PROG_LOAD failed");
+        }
+        ret = ioctl(fd, FIFO_SET_BPF, &attach);
+        if (ret != 0)
+            perror("ioctl() failed");
+        // the device holds its own reference
+        if (attach.fd >= 0)
+            close(attach.fd);
+    }
+    else if (strcmp(argv[1], "bpfstats") == 0)
+    {
+        bpf_stats_t bpf_stats;
+        ret = ioctl(fd, FIFO_BPF_STATS, &bpf_stats);
+        if (ret != 0)
+            perror("ioctl() failed");
+        else
+            printf("accepted=%llu, dropped=%llu (%llu bytes), sampled=%llu, sample_skipped=%llu\n",
+                bpf_stats.accepted, bpf_stats.dropped, bpf_stats.dropped_bytes, bpf_stats.sampled, bpf_stats.sample_skipped);
+    }
+    else if (strcmp(argv[1], "dmabuf") == 0)
+    {
+        // dmabuf [lane] -> export, then print one window of data through the mapping
+        dmabuf_export_t exp;
+        dmabuf_window_t win;
+        char *map;
+        exp.lane = (argc > 2) ? atoi(argv[2]) : 0;
+        ret = ioctl(fd, FIFO_EXPORT_DMABUF, &exp);
+        if (ret != 0)
+        {
+            perror("ioctl() failed");
+            close(fd);
+            return 1;
+        }
+        map = mmap(NULL, exp.size, PROT_READ, MAP_SHARED, exp.fd, 0);
+        if (map == MAP_FAILED)
+            perror("mmap() failed");
+        else if (ioctl(fd, FIFO_DMABUF_BEGIN, &win) != 0)
+            perror("ioctl() failed");
+        else
+        {
+            printf("dma-buf fd=%d size=%u window offset=%u len=%u: %.*s\n", exp.fd, exp.size, win.offset, win.len, win.len, map + win.offset);
+            ioctl(fd, FIFO_DMABUF_END, (unsigned long)win.len);
+        }
+        if (map != MAP_FAILED)
+            munmap(map, exp.size);
+        close(exp.fd);
+    }
+    else if (strcmp(argv[1], "elastic") == 0)
+    {
+        // elastic <min> <max> <high%> <low%> [shrink_ms], elastic off
+        elastic_t elastic;
+        memset(&elastic, 0, sizeof(elastic));
+        if (argc > 5)
+        {
+            elastic.min_size = atoi(argv[2]);
+            elastic.max_size = atoi(argv[3]);
+            elastic.high_pct = atoi(argv[4]);
+            elastic.low_pct = atoi(argv[5]);
+            elastic.shrink_ms = (argc > 6) ? atoi(argv[6]) : 0;
+        }
+        ret = ioctl(fd, FIFO_SET_ELASTIC, &elastic);
+        if (ret != 0)
+            perror("ioctl() failed");
+    }
+    else if (strcmp(argv[1], "elstats") == 0)
+    {
+        elastic_stats_t el;
+        ret = ioctl(fd, FIFO_ELASTIC_STATS, &el);
+        if (ret != 0)
+            perror("ioctl() failed");
+        else
+            printf("grows=%llu, shrinks=%llu, stalls=%llu, failed=%llu\n", el.grows, el.shrinks, el.stalls, el.failed);
+    }
+    else if (strcmp(argv[1], "lz") == 0)
+    {
+        // lz <chunk>, lz off
+        long chunk = (argc > 2 && strcmp(argv[2], "off") != 0) ? atol(argv[2]) : 0;
+        ret = ioctl(fd, FIFO_SET_LZ, chunk);
+        if (ret != 0)
+            perror("ioctl() failed");
+    }
+    else if (strcmp(argv[1], "infox") == 0)
+    {
+        info_ex_t ix;
+        ret = ioctl(fd, FIFO_INFO_EX, &ix);
+        if (ret != 0)
+            perror("ioctl() failed");
+        else
+            printf("size=%u, filled=%u, logical=%llu, lz chunk=%u, chunks=%llu (%llu raw), %llu -> %llu bytes\n",
+                ix.size, ix.len, ix.logical_len, ix.lz_chunk, ix.lz.chunks, ix.lz.raw_chunks, ix.lz.in, ix.lz.stored);
+    }
+    else if (strcmp(argv[1], "rate") == 0)
+    {
+        // rate <bytes/s> <ops/s> [eagain], device limit, 0 = unlimited
+        rate_limit_t rl;
+        memset(&rl, 0, sizeof(rl));
+        rl.bytes_per_sec = (argc > 2) ? atoll(argv[2]) : 0;
+        rl.ops_per_sec = (argc > 3) ? atoi(argv[3]) : 0;
+        rl.policy = (argc > 4 && strcmp(argv[4], "eagain") == 0) ? PCHAR_RATE_EAGAIN : PCHAR_RATE_SLEEP;
+        ret = ioctl(fd, FIFO_SET_RATE, &rl);
+        if (ret != 0)
+            perror("ioctl() failed");
+    }
+    else if (strcmp(argv[1], "ratewrite") == 0)
+    {
+        // ratewrite <bytes/s> <bytes>: write under a limit of this file only, a reader must drain
+        rate_limit_t rl;
+        rate_stats_t rs;
+        char buf[256];
+        long total = (argc > 3) ? atol(argv[3]) : 4096, done = 0;
+        time_t start = time(NULL);
+        memset(&rl, 0, sizeof(rl));
+        memset(buf, 'r', sizeof(buf));
+        rl.bytes_per_sec = (argc > 2) ? atoll(argv[2]) : 1024;
+        rl.per_file = 1;
+        ret = ioctl(fd, FIFO_SET_RATE, &rl);
+        while (ret == 0 && done < total)
+        {
+            ret = write(fd, buf, total - done < (long)sizeof(buf) ? total - done : (long)sizeof(buf));
+            if (ret < 0)
+                break;
+            done += ret;
+            ret = 0;
+        }
+        if (ret != 0 || ioctl(fd, FIFO_RATE_STATS, &rs) != 0)
+            perror("failed");
+        else
+            printf("%ld bytes in %lds, throttled=%llu, throttle_ns=%llu\n", done, (long)(time(NULL) - start), rs.file.throttled, rs.file.throttle_ns);
+    }
+    else if (strcmp(argv[1], "ratestats") == 0)
+    {
+        rate_stats_t rs;
+        ret = ioctl(fd, FIFO_RATE_STATS, &rs);
+        if (ret != 0)
+            perror("ioctl() failed");
+        else
+            printf("device: throttled=%llu, throttle_ns=%llu, refused=%llu\n", rs.dev.throttled, rs.dev.throttle_ns, rs.dev.refused);
+    }
+    else if (strcmp(argv[1], "notify") == 0)
+    {
+        // notify <rise%> <fall%>: print fill crossings till interrupted, notify off
+        fill_notify_t fn;
+        struct pollfd pfd[2];
+        uint64_t cnt;
+        info_t info;
+        fn.rise_fd = fn.fall_fd = -1;
+        fn.rise_pct = (argc > 2) ? atoi(argv[2]) : 80;
+        fn.fall_pct = (argc > 3) ? atoi(argv[3]) : 10;
+        if (argc > 2 && strcmp(argv[2], "off") != 0)
+        {
+            fn.rise_fd = eventfd(0, 0);
+            fn.fall_fd = eventfd(0, 0);
+        }
+        ret = ioctl(fd, FIFO_FILL_NOTIFY, &fn);
+        if (ret != 0)
+            perror("ioctl() failed");
+        pfd[0].fd = fn.rise_fd;
+        pfd[1].fd = fn.fall_fd;
+        pfd[0].events = pfd[1].events = POLLIN;
+        while (ret == 0 && fn.rise_fd >= 0 && poll(pfd, 2, -1) > 0)
+        {
+            ioctl(fd, FIFO_INFO, &info);
+            if ((pfd[0].revents & POLLIN) && read(fn.rise_fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+                printf("above %u%%: filled=%d of %d\n", fn.rise_pct, info.len, info.size);
+            if ((pfd[1].revents & POLLIN) && read(fn.fall_fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+                printf("below %u%%: filled=%d of %d\n", fn.fall_pct, info.len, info.size);
+        }
+    }
+    else if (strcmp(argv[1], "all") == 0)
+    {
+        // drain all devices through the fan-in node
+        char buf[512];
+        int all_fd, off, nbytes;
+        rec_hdr_t hdr;
+        all_fd = open("/dev/my_char_all", O_RDONLY);
+        if (all_fd < 0)
+            perror("open() failed");
+        while (all_fd >= 0 && (nbytes = read(all_fd, buf, sizeof(buf))) > 0)
+        {
+            for (off = 0; off < nbytes; off += sizeof(hdr) + hdr.len)
+            {
+                memcpy(&hdr, buf + off, sizeof(hdr));
+                printf("my_char%d: %.*s\n", hdr.minor, hdr.len, buf + off + sizeof(hdr));
+            }
+        }
+        if (all_fd >= 0)
+            close(all_fd);
+    }
     else
     {
         printf("invalid usage.\n");
@@ -0,0 +1,38 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pchar
+
+#if !defined(_PCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// every lane fifo reallocation: FIFO_RESIZE, elastic sizing, shrinker trims
+TRACE_EVENT(pchar_resize,
+    TP_PROTO(int minor, int lane, unsigned int old_size, unsigned int new_size, unsigned int len),
+    TP_ARGS(minor, lane, old_size, new_size, len),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(int, lane)
+        __field(unsigned int, old_size)
+        __field(unsigned int, new_size)
+        __field(unsigned int, len)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->lane = lane;
+        __entry->old_size = old_size;
+        __entry->new_size = new_size;
+        __entry->len = len;
+    ),
+    TP_printk("my_char%d lane=%d size %u -> %u len=%u",
+        __entry->minor, __entry->lane, __entry->old_size, __entry->new_size, __entry->len)
+);
+
+#endif
+
+// kbuild needs CFLAGS_pchar_multidev_ioctl.o := -I$(src) for this
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pchar_trace
+#include <trace/define_trace.h>
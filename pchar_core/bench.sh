@@ -0,0 +1,39 @@
+#!/bin/sh
+# Compare the legacy day8_1, day8_3 and day9_1 drivers as they were before
+# the shared core with their pchar_core configurations. Run as root from
+# pchar_core/ on a machine with kernel headers:
+#   ./bench.sh [chunk] [iterations]
+# ORIG_REV picks the tree the original drivers are built from, by default
+# the parent of the commit that introduced the core.
+set -e
+CHUNK=${1:-16}
+ITERS=${2:-200000}
+TOP=$(git rev-parse --show-toplevel)
+ORIG_REV=${ORIG_REV:-$(git log --format=%H --diff-filter=A -- pchar_core.c | tail -1)^}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+make -s bench
+
+# run <ko> <device> <label> [params]
+run() {
+    ko=$1; dev=$2; label=$3; shift 3
+    insmod "$ko" "$@"
+    printf "%-28s " "$label"
+    ./pchar_bench "$dev" "$CHUNK" "$ITERS"
+    rmmod "$(basename "$ko" .ko)"
+}
+
+for v in day8_1:pchar_multidev:/dev/my_char0 day8_3:pchar_multidev:/dev/my_char0 day9_1:pchar:/dev/pchar0; do
+    dir=${v%%:*}; rest=${v#*:}; mod=${rest%%:*}; dev=${rest#*:}
+
+    mkdir -p "$WORK/orig/$dir"
+    git -C "$TOP" show "$ORIG_REV:$dir/$mod.c" > "$WORK/orig/$dir/$mod.c"
+    echo "obj-m = $mod.o" > "$WORK/orig/$dir/Makefile"
+    make -s -C /lib/modules/$(uname -r)/build M="$WORK/orig/$dir" modules
+    make -s -C "$TOP/$dir" modules
+
+    run "$WORK/orig/$dir/$mod.ko" "$dev" "$dir original"
+    run "$TOP/$dir/$mod.ko" "$dev" "$dir core logging=1"
+    run "$TOP/$dir/$mod.ko" "$dev" "$dir core logging=0" logging=0
+done
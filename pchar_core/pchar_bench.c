@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+/*
+ * Write/read round trip benchmark for any pchar configuration.
+ *   ./pchar_bench /dev/my_char0 [chunk] [iterations]
+ * Each iteration writes chunk bytes and reads them back from the same
+ * file, so it never blocks on the blocking configurations either.
+ */
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : "/dev/my_char0";
+    int chunk = argc > 2 ? atoi(argv[2]) : 16;
+    long iters = argc > 3 ? atol(argv[3]) : 200000;
+    unsigned long long start, elapsed;
+    char *buf;
+    long i;
+    int fd;
+
+    if (chunk <= 0 || iters <= 0)
+    {
+        printf("usage: %s [device] [chunk] [iterations]\n", argv[0]);
+        _exit(2);
+    }
+    buf = malloc(chunk);
+    memset(buf, 'x', chunk);
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        perror("open() failed");
+        _exit(1);
+    }
+
+    start = now_ns();
+    for (i = 0; i < iters; i++)
+    {
+        if (write(fd, buf, chunk) != chunk)
+        {
+            perror("write() failed or short, chunk bigger than fifo?");
+            _exit(1);
+        }
+        if (read(fd, buf, chunk) != chunk)
+        {
+            perror("read() failed or short");
+            _exit(1);
+        }
+    }
+    elapsed = now_ns() - start;
+
+    printf("%s chunk=%d: %.1f ns per write+read, %.1f MB/s\n", path, chunk,
+        (double)elapsed / iters, (double)chunk * iters * 1000.0 / elapsed);
+    close(fd);
+    free(buf);
+    return 0;
+}
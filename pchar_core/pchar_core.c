@@ -0,0 +1,446 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/kfifo.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/semaphore.h>
+#include <linux/jump_label.h>
+#include <linux/moduleparam.h>
+#include "../day8_2/pchar_ioctl.h"
+
+/*
+ * Shared pchar core. day8_1, day8_3 and day9_1 are this file built with
+ * their own PCHAR_DEF_* defaults, and every default can still be changed
+ * at insmod time. Optional behaviors sit behind static keys, so a
+ * disabled one is a nop in read/write instead of a test and branch.
+ *
+ *   blocking     readers wait for data and writers for space (day8_3)
+ *   use_ioctl    FIFO_CLEAR, FIFO_INFO, FIFO_RESIZE of pchar_ioctl.h
+ *   single_open  one open file per device at a time (day9_1)
+ *   logging      printk on every call, can be changed at run time
+ */
+
+#ifndef PCHAR_DEF_DEVCNT
+#define PCHAR_DEF_DEVCNT 3
+#endif
+#ifndef PCHAR_DEF_NAME
+#define PCHAR_DEF_NAME "my_char"
+#endif
+#ifndef PCHAR_DEF_CLASS
+#define PCHAR_DEF_CLASS "multidev_char"
+#endif
+#ifndef PCHAR_DEF_BLOCKING
+#define PCHAR_DEF_BLOCKING true
+#endif
+#ifndef PCHAR_DEF_IOCTL
+#define PCHAR_DEF_IOCTL true
+#endif
+#ifndef PCHAR_DEF_SINGLE_OPEN
+#define PCHAR_DEF_SINGLE_OPEN false
+#endif
+#ifndef PCHAR_DEF_LOGGING
+#define PCHAR_DEF_LOGGING false
+#endif
+#ifndef PCHAR_DESCRIPTION
+#define PCHAR_DESCRIPTION "pchar core with static key selected features"
+#endif
+
+#define MAX 32
+#define PCHAR_FIFO_MAX (1 << 24) // largest FIFO_RESIZE size
+
+static int pchar_open(struct inode *pinode, struct file *pfile);
+static int pchar_close(struct inode *pinode, struct file *pfile);
+static ssize_t pchar_read(struct file *pfile, char *ubuf, size_t size, loff_t *poffset);
+static ssize_t pchar_write(struct file *pfile, const char *ubuf, size_t size, loff_t *poffset);
+static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param);
+
+// device private struct
+struct pchar_device
+{
+    struct kfifo my_buf;
+    dev_t my_devno;
+    struct cdev my_cdev;
+    // kfifo needs no lock for one reader and one writer, these serialize the rest
+    struct mutex rd_lock;
+    struct mutex wr_lock;
+    wait_queue_head_t wr_wq;
+    wait_queue_head_t rd_wq;
+    struct semaphore open_sem;
+};
+
+static struct file_operations my_fops = {
+    .owner = THIS_MODULE,
+    .open = pchar_open,
+    .release = pchar_close,
+    .read = pchar_read,
+    .write = pchar_write
+};
+
+static struct file_operations my_ioctl_fops = {
+    .owner = THIS_MODULE,
+    .open = pchar_open,
+    .release = pchar_close,
+    .read = pchar_read,
+    .write = pchar_write,
+    .unlocked_ioctl = pchar_ioctl
+};
+
+static DEFINE_STATIC_KEY_FALSE(pchar_blocking_key);
+static DEFINE_STATIC_KEY_FALSE(pchar_single_open_key);
+static DEFINE_STATIC_KEY_FALSE(pchar_log_key);
+
+#define pchar_log(fmt, ...) \
+    do { \
+        if (static_branch_unlikely(&pchar_log_key)) \
+            printk(KERN_INFO "%s : " fmt, THIS_MODULE->name, ##__VA_ARGS__); \
+    } while (0)
+
+static int major;
+static struct class *pclass;
+static int my_devcnt = PCHAR_DEF_DEVCNT;
+module_param(my_devcnt,int,0444);
+MODULE_PARM_DESC(my_devcnt, "number of devices");
+static char *devname = PCHAR_DEF_NAME;
+module_param(devname,charp,0444);
+MODULE_PARM_DESC(devname, "chrdev region and device node prefix");
+static char *classname = PCHAR_DEF_CLASS;
+module_param(classname,charp,0444);
+static bool blocking = PCHAR_DEF_BLOCKING;
+module_param(blocking,bool,0444);
+MODULE_PARM_DESC(blocking, "sleep on empty reads and full writes unless O_NONBLOCK");
+static bool use_ioctl = PCHAR_DEF_IOCTL;
+module_param(use_ioctl,bool,0444);
+static bool one_open = PCHAR_DEF_SINGLE_OPEN; // single_open() is taken by seq_file
+module_param_named(single_open,one_open,bool,0444);
+MODULE_PARM_DESC(single_open, "allow one open file per device, others wait");
+static bool logging = PCHAR_DEF_LOGGING;
+struct pchar_device *my_devices;
+
+static int logging_set(const char *val, const struct kernel_param *kp)
+{
+    int ret;
+
+    ret = param_set_bool(val, kp);
+    if (ret != 0)
+        return ret;
+    if (logging)
+        static_branch_enable(&pchar_log_key);
+    else
+        static_branch_disable(&pchar_log_key);
+    return 0;
+}
+
+static const struct kernel_param_ops logging_ops = {
+    .set = logging_set,
+    .get = param_get_bool
+};
+module_param_cb(logging, &logging_ops, &logging, 0644);
+MODULE_PARM_DESC(logging, "printk on every open, read and write");
+
+static __init int pchar_init(void)
+{
+    dev_t devno;
+    int ret, i;
+    struct device *pdevices;
+
+    if (my_devcnt < 1)
+        return -EINVAL;
+    if (blocking)
+        static_branch_enable(&pchar_blocking_key);
+    if (one_open)
+        static_branch_enable(&pchar_single_open_key);
+    if (logging)
+        static_branch_enable(&pchar_log_key);
+    pchar_log("pchar_init called, blocking=%d ioctl=%d single_open=%d\n", blocking, use_ioctl, one_open);
+
+    // zeroed so that kfifo_free() is safe on fifos never allocated
+    my_devices = kcalloc(my_devcnt, sizeof(struct pchar_device), GFP_KERNEL);
+    if (my_devices == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i < my_devcnt; i++)
+    {
+        mutex_init(&my_devices[i].rd_lock);
+        mutex_init(&my_devices[i].wr_lock);
+        init_waitqueue_head(&my_devices[i].wr_wq);
+        init_waitqueue_head(&my_devices[i].rd_wq);
+        sema_init(&my_devices[i].open_sem, 1);
+        ret = kfifo_alloc(&my_devices[i].my_buf, MAX, GFP_KERNEL);
+        if (ret != 0)
+        {
+            printk(KERN_ERR "%s : kfifo_alloc() is failed for device %d\n", THIS_MODULE->name, i);
+            goto kfifo_alloc_failed;
+        }
+    }
+
+    ret = alloc_chrdev_region(&devno, 0, my_devcnt, devname);
+    if (ret != 0)
+    {
+        printk(KERN_ERR "%s : alloc_chrdev_region_failed\n", THIS_MODULE->name);
+        goto kfifo_alloc_failed;
+    }
+    major = MAJOR(devno);
+
+    pclass = class_create(THIS_MODULE, classname);
+    if (IS_ERR(pclass))
+    {
+        printk(KERN_ERR "%s : class_create is failed\n", THIS_MODULE->name);
+        ret = PTR_ERR(pclass);
+        goto class_create_failed;
+    }
+
+    for (i = 0; i < my_devcnt; i++)
+    {
+        my_devices[i].my_devno = MKDEV(major, i);
+        pdevices = device_create(pclass, NULL, my_devices[i].my_devno, NULL, "%s%d", devname, i);
+        if (IS_ERR(pdevices))
+        {
+            printk(KERN_ERR "%s : device_create is failed for device %d\n", THIS_MODULE->name, i);
+            ret = PTR_ERR(pdevices);
+            goto device_create_failed;
+        }
+    }
+
+    for (i = 0; i < my_devcnt; i++)
+    {
+        cdev_init(&my_devices[i].my_cdev, use_ioctl ? &my_ioctl_fops : &my_fops);
+        ret = cdev_add(&my_devices[i].my_cdev, my_devices[i].my_devno, 1);
+        if (ret != 0)
+        {
+            printk(KERN_ERR "%s : cdev_add is failed\n", THIS_MODULE->name);
+            goto cdev_add_failed;
+        }
+    }
+    printk(KERN_INFO "%s : %d devices %s0.. major=%d\n", THIS_MODULE->name, my_devcnt, devname, major);
+    return 0;
+
+cdev_add_failed:
+    for (i = i - 1; i >= 0; i--)
+        cdev_del(&my_devices[i].my_cdev);
+    i = my_devcnt;
+device_create_failed:
+    for (i = i - 1; i >= 0; i--)
+        device_destroy(pclass, my_devices[i].my_devno);
+    class_destroy(pclass);
+class_create_failed:
+    unregister_chrdev_region(devno, my_devcnt);
+kfifo_alloc_failed:
+    for (i = my_devcnt - 1; i >= 0; i--)
+        kfifo_free(&my_devices[i].my_buf);
+    kfree(my_devices);
+    return ret;
+}
+
+static __exit void pchar_exit(void)
+{
+    int i;
+
+    pchar_log("pchar_exit is called\n");
+    for (i = my_devcnt - 1; i >= 0; i--)
+        cdev_del(&my_devices[i].my_cdev);
+    for (i = my_devcnt - 1; i >= 0; i--)
+        device_destroy(pclass, my_devices[i].my_devno);
+    class_destroy(pclass);
+    unregister_chrdev_region(MKDEV(major, 0), my_devcnt);
+    for (i = my_devcnt - 1; i >= 0; i--)
+        kfifo_free(&my_devices[i].my_buf);
+    kfree(my_devices);
+}
+
+static int pchar_open(struct inode *pinode, struct file *pfile)
+{
+    struct pchar_device *pdev = container_of(pinode->i_cdev, struct pchar_device, my_cdev);
+
+    pchar_log("pchar_open is called\n");
+    if (static_branch_unlikely(&pchar_single_open_key))
+    {
+        if (pfile->f_flags & O_NONBLOCK)
+        {
+            if (down_trylock(&pdev->open_sem))
+                return -EBUSY;
+        }
+        else if (down_interruptible(&pdev->open_sem))
+            return -ERESTARTSYS;
+    }
+    pfile->private_data = pdev;
+    return 0;
+}
+
+static int pchar_close(struct inode *pinode, struct file *pfile)
+{
+    struct pchar_device *pdev = (struct pchar_device*)pfile->private_data;
+
+    pchar_log("pchar_close is called\n");
+    if (static_branch_unlikely(&pchar_single_open_key))
+        up(&pdev->open_sem);
+    return 0;
+}
+
+static ssize_t pchar_read(struct file *pfile, char *ubuf, size_t size, loff_t *poffset)
+{
+    struct pchar_device *pdev = (struct pchar_device*)pfile->private_data;
+    unsigned int nbytes;
+    int ret;
+
+    pchar_log("pchar_read is called\n");
+    if (size == 0)
+        return 0;
+    while (1)
+    {
+        if (static_branch_unlikely(&pchar_blocking_key))
+        {
+            if ((pfile->f_flags & O_NONBLOCK) && kfifo_is_empty(&pdev->my_buf))
+                return -EAGAIN;
+            ret = wait_event_interruptible(pdev->rd_wq, !kfifo_is_empty(&pdev->my_buf)); // interruptible sleep
+            if (ret != 0)
+                return -ERESTARTSYS;
+        }
+        mutex_lock(&pdev->rd_lock);
+        ret = kfifo_to_user(&pdev->my_buf, ubuf, size, &nbytes);
+        mutex_unlock(&pdev->rd_lock);
+        if (ret < 0)
+        {
+            printk(KERN_ERR "%s : pchar_read is failed to copy data to user space\n", THIS_MODULE->name);
+            return ret;
+        }
+        if (!static_branch_unlikely(&pchar_blocking_key))
+            break;
+        // another reader may have emptied the fifo since wakeup
+        if (nbytes != 0)
+        {
+            wake_up_interruptible(&pdev->wr_wq);
+            break;
+        }
+    }
+    pchar_log("bytes read to user space %u\n", nbytes);
+    return nbytes;
+}
+
+static ssize_t pchar_write(struct file *pfile, const char *ubuf, size_t size, loff_t *poffset)
+{
+    struct pchar_device *pdev = (struct pchar_device*)pfile->private_data;
+    unsigned int nbytes;
+    int ret;
+
+    pchar_log("pchar_write is called\n");
+    if (size == 0)
+        return 0;
+    while (1)
+    {
+        if (static_branch_unlikely(&pchar_blocking_key))
+        {
+            if ((pfile->f_flags & O_NONBLOCK) && kfifo_is_full(&pdev->my_buf))
+                return -EAGAIN;
+            ret = wait_event_interruptible(pdev->wr_wq, !kfifo_is_full(&pdev->my_buf)); // interruptible sleep
+            if (ret != 0)
+                return -ERESTARTSYS;
+        }
+        mutex_lock(&pdev->wr_lock);
+        ret = kfifo_from_user(&pdev->my_buf, ubuf, size, &nbytes);
+        mutex_unlock(&pdev->wr_lock);
+        if (ret < 0)
+        {
+            printk(KERN_ERR "%s : pchar_write is failed to copy data from user space\n", THIS_MODULE->name);
+            return ret;
+        }
+        if (!static_branch_unlikely(&pchar_blocking_key))
+            break;
+        if (nbytes != 0)
+        {
+            wake_up_interruptible(&pdev->rd_wq);
+            break;
+        }
+    }
+    pchar_log("bytes written from user space %u\n", nbytes);
+    return nbytes;
+}
+
+// move fifo content into a new fifo of given size; data beyond new size is dropped
+static int pchar_resize_fifo(struct kfifo *fifo, unsigned long size)
+{
+    struct kfifo new_fifo;
+    void *temp_buf;
+    unsigned int len;
+    int ret;
+
+    ret = kfifo_alloc(&new_fifo, size, GFP_KERNEL);
+    if (ret != 0)
+        return ret;
+    len = min(kfifo_len(fifo), kfifo_size(&new_fifo));
+    temp_buf = kmalloc(len, GFP_KERNEL);
+    if (temp_buf == NULL)
+    {
+        kfifo_free(&new_fifo);
+        return -ENOMEM;
+    }
+    len = kfifo_out(fifo, temp_buf, len);
+    kfifo_in(&new_fifo, temp_buf, len);
+    kfree(temp_buf);
+    kfifo_free(fifo);
+    *fifo = new_fifo;
+    return 0;
+}
+
+static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param)
+{
+    struct pchar_device *pdev = (struct pchar_device*)pfile->private_data;
+    info_t info;
+    int ret = 0;
+
+    switch (cmd)
+    {
+        case FIFO_CLEAR:
+            mutex_lock(&pdev->rd_lock);
+            mutex_lock(&pdev->wr_lock);
+            kfifo_reset(&pdev->my_buf);
+            mutex_unlock(&pdev->wr_lock);
+            mutex_unlock(&pdev->rd_lock);
+            // writers sleeping on a full fifo have room now
+            if (static_branch_unlikely(&pchar_blocking_key))
+                wake_up_interruptible(&pdev->wr_wq);
+            break;
+
+        case FIFO_INFO:
+            memset(&info, 0, sizeof(info_t));
+            mutex_lock(&pdev->rd_lock);
+            mutex_lock(&pdev->wr_lock);
+            info.size = kfifo_size(&pdev->my_buf);
+            info.avail = kfifo_avail(&pdev->my_buf);
+            info.len = kfifo_len(&pdev->my_buf);
+            mutex_unlock(&pdev->wr_lock);
+            mutex_unlock(&pdev->rd_lock);
+            if (copy_to_user((void*)param, &info, sizeof(info_t)))
+                return -EFAULT;
+            break;
+
+        case FIFO_RESIZE:
+            if (param < 2 || param > PCHAR_FIFO_MAX)
+                return -EINVAL;
+            mutex_lock(&pdev->rd_lock);
+            mutex_lock(&pdev->wr_lock);
+            ret = pchar_resize_fifo(&pdev->my_buf, param);
+            mutex_unlock(&pdev->wr_lock);
+            mutex_unlock(&pdev->rd_lock);
+            if (ret != 0)
+                return ret;
+            if (static_branch_unlikely(&pchar_blocking_key))
+                wake_up_interruptible(&pdev->wr_wq);
+            pchar_log("fifo resize to %u done\n", kfifo_size(&pdev->my_buf));
+            break;
+
+        default:
+            return -ENOTTY;
+    }
+    return 0;
+}
+
+module_init(pchar_init);
+module_exit(pchar_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Parth");
+MODULE_DESCRIPTION(PCHAR_DESCRIPTION);